@@ -0,0 +1,291 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "virtual_sbrk.h"
+#include "structure.h"
+#include "virtual_alloc.h"
+
+/**
+ * Interposes the C allocation functions with buddy heaps so that
+ * unmodified programs can be run on this allocator via LD_PRELOAD.
+ * Only mmap is used to obtain memory, so every function is safe to
+ * call before the C library has finished starting up.
+ */
+
+// shared heaps of 64 MiB with 32 byte blocks
+#define HEAP_SIZE 26
+#define HEAP_MIN 5
+
+// storage alignment of every heap, and most heaps which can exist
+#define PAGE 4096
+#define REGIONS 256
+
+/**
+ * A mapping holding one heap. Dedicated regions contain a single
+ * block for a request too large, or too aligned, for a shared heap.
+ */
+struct Region {
+    void* heapstart;
+    void* storage;
+    void* end;
+    void* mapping;
+    size_t length;
+    int dedicated;
+};
+
+struct Region regions[REGIONS];
+int current = 0;
+int lock = 0;
+
+void* program_break = NULL;
+
+void* virtual_sbrk(int32_t increment) {
+    // regions are mapped up front, so only the break is moved
+    void* previous_break = program_break;
+    program_break += increment;
+
+    return previous_break;
+}
+
+// HELPER FUNCTIONS
+
+void acquire() {
+    while (__atomic_test_and_set(&lock, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+void release() {
+    __atomic_clear(&lock, __ATOMIC_RELEASE);
+}
+
+__attribute__((constructor))
+void register_fork() {
+    // keep the heaps consistent in a child forked mid allocation
+    pthread_atfork(acquire, release, release);
+}
+
+int create_region(uint8_t size, uint8_t min_size, size_t align, int dedicated) {
+    int index = -1;
+    for (int i = 0; i < REGIONS && index < 0; i++) {
+        if (regions[i].heapstart == NULL)
+            index = i;
+    }
+
+    if (index < 0)
+        return -1;
+
+    struct Heap layout = { .min_size = min_size, .cur_size = size };
+    size_t header = overhead(&layout);
+    size_t length = header + align + ((size_t) 1 << size) + PAGE;
+
+    void* mapping = mmap(NULL, length, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED)
+        return -1;
+
+    // place the heap so that its storage starts on an aligned address
+    uintptr_t storage = ((uintptr_t) mapping + header + align - 1) & ~(align - 1);
+    void* heapstart = (void*) (storage - header);
+
+    program_break = heapstart;
+    init_allocator(heapstart, size, min_size);
+    virtual_config(heapstart, OPT_ZEROED, 1);
+
+    struct Region* region = &regions[index];
+    region->heapstart = heapstart;
+    region->storage = (void*) storage;
+    region->end = (void*) storage + ((size_t) 1 << size);
+    region->mapping = mapping;
+    region->length = length;
+    region->dedicated = dedicated;
+    return index;
+}
+
+struct Region* find_region(void* ptr) {
+    for (int i = 0; i < REGIONS; i++) {
+        struct Region* region = &regions[i];
+        if (region->heapstart && ptr >= region->storage && ptr < region->end)
+            return region;
+    }
+
+    return NULL;
+}
+
+void* allocate_block(void* heapstart, size_t size, int zero) {
+    return (zero) ? virtual_calloc(heapstart, 1, size)
+                  : virtual_malloc(heapstart, size);
+}
+
+void* allocate_aligned(size_t size, size_t align, int zero) {
+    if (size < align)
+        size = align;
+    if (size == 0)
+        size = 1;
+    if (size > ((size_t) 1 << 30))
+        return NULL;
+
+    if (size <= ((size_t) 1 << HEAP_SIZE) && align <= PAGE) {
+        // blocks are aligned to their size within a page aligned heap
+        for (int i = 0; i < REGIONS; i++) {
+            struct Region* region = &regions[(current + i) % REGIONS];
+            if (region->heapstart == NULL || region->dedicated)
+                continue;
+
+            void* address = allocate_block(region->heapstart, size, zero);
+            if (address) {
+                current = region - regions;
+                return address;
+            }
+        }
+
+        int index = create_region(HEAP_SIZE, HEAP_MIN, PAGE, 0);
+        if (index < 0)
+            return NULL;
+
+        current = index;
+        return allocate_block(regions[index].heapstart, size, zero);
+    }
+
+    // a single block heap for requests no shared heap can serve
+    uint8_t order = 0;
+    while (((size_t) 1 << order) < size) {
+        order++;
+    }
+
+    int index = create_region(order, order, (align > PAGE) ? align : PAGE, 1);
+    return (index < 0) ? NULL : allocate_block(regions[index].heapstart, size, zero);
+}
+
+void release_block(struct Region* region, void* ptr) {
+    if (region->dedicated) {
+        munmap(region->mapping, region->length);
+        memset(region, 0, sizeof(struct Region));
+    } else {
+        virtual_free(region->heapstart, ptr);
+    }
+}
+
+size_t block_size(struct Region* region, void* ptr) {
+    return virtual_usable_size(region->heapstart, ptr);
+}
+
+// INTERPOSED FUNCTIONS
+
+void* malloc(size_t size) {
+    acquire();
+    void* address = allocate_aligned(size, 16, 0);
+    release();
+
+    if (address == NULL)
+        errno = ENOMEM;
+    return address;
+}
+
+void free(void* ptr) {
+    if (ptr == NULL)
+        return;
+
+    acquire();
+    struct Region* region = find_region(ptr);
+    if (region)
+        release_block(region, ptr);
+    release();
+}
+
+void* calloc(size_t count, size_t size) {
+    if (size && count > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // memory fresh from mmap is not cleared again
+    acquire();
+    void* address = allocate_aligned(count * size, 16, 1);
+    release();
+
+    if (address == NULL)
+        errno = ENOMEM;
+    return address;
+}
+
+void* realloc(void* ptr, size_t size) {
+    if (ptr == NULL)
+        return malloc(size);
+
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+    acquire();
+    struct Region* region = find_region(ptr);
+    if (region == NULL) {
+        release();
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // resize in place, else move the block to another heap
+    size_t old_size = block_size(region, ptr);
+    void* address = NULL;
+    if (!region->dedicated && size <= UINT32_MAX)
+        address = virtual_realloc(region->heapstart, ptr, size);
+
+    if (address == NULL) {
+        address = allocate_aligned(size, 16, 0);
+        if (address) {
+            memcpy(address, ptr, (old_size < size) ? old_size : size);
+            release_block(region, ptr);
+        }
+    }
+    release();
+
+    if (address == NULL)
+        errno = ENOMEM;
+    return address;
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)))
+        return EINVAL;
+
+    acquire();
+    void* address = allocate_aligned(size, alignment, 0);
+    release();
+
+    if (address == NULL)
+        return ENOMEM;
+
+    *memptr = address;
+    return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    void* address = NULL;
+    int error = posix_memalign(&address, alignment, size);
+
+    if (error)
+        errno = error;
+    return address;
+}
+
+void* memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
+
+size_t malloc_usable_size(void* ptr) {
+    if (ptr == NULL)
+        return 0;
+
+    acquire();
+    struct Region* region = find_region(ptr);
+    size_t size = (region) ? block_size(region, ptr) : 0;
+    release();
+
+    return size;
+}
@@ -1,181 +1,492 @@
+#include <stddef.h>
+#include <string.h>
+
 #include "structure.h"
 
+// every other bit, the low bit of each node in a word of the tree
+#define LOW_BITS 0x5555555555555555
+
 
 // HEAP INFORMATION
 
+uint64_t tree_nodes(struct Heap* heap) {
+    return (uint64_t) 1 << (heap->cur_size - heap->min_size + 1);
+}
+
+uint64_t* zero_bits(struct Heap* heap) {
+    return heap->tree + (tree_nodes(heap) + 31) / 32;
+}
+
 uint64_t overhead(struct Heap* heap) {
-    return 2 + (1 << (heap->cur_size - heap->min_size + 1));
+    uint64_t nodes = tree_nodes(heap);
+    uint64_t words = (nodes + 31) / 32 + (nodes + 63) / 64;
+    return offsetof(struct Heap, tree) + words * sizeof(uint64_t);
+}
+
+void* heap_storage(struct Heap* heap) {
+    return (void*) heap + heap->storage;
 }
 
 
 // NODE VERIFICATION
 
-int in_tree(struct Heap* heap, uint8_t* node) {
-    uint8_t* last = ((void*) heap) + overhead(heap);
-    uint8_t* root = &heap->root;
-    return node - root >= 0 && last - node >= 0;
+int in_tree(struct Heap* heap, uint64_t node) {
+    return node >= ROOT && node < tree_nodes(heap);
 }
 
-int is_valid(struct Heap* heap, uint8_t* node) {
-    return in_tree(heap, node) && status(node) > 0;
+int is_valid(struct Heap* heap, uint64_t node) {
+    return in_tree(heap, node) && status(heap, node) > 0;
 }
 
 
 // NODE DATA
 
-uint64_t node_size(struct Heap* heap, uint8_t* node) {
-    if (node == &heap->root) {
-        return heap->cur_size;
-    } else {
-        uint8_t* parent_node = node_parent(heap, node);
-        return node_size(heap, parent_node) - 1;
-    }
+uint8_t depth(uint64_t node) {
+    return 63 - __builtin_clzll(node);
 }
 
-uint8_t status(uint8_t* node) {
-    return (node) ? *node & 0b11 : INACTIVE;
+uint64_t node_size(struct Heap* heap, uint64_t node) {
+    return heap->cur_size - depth(node);
 }
 
-uint8_t backup(uint8_t* node) {
-    return (node) ? (*node >> 2) & 0b11 : INACTIVE;
+uint8_t status(struct Heap* heap, uint64_t node) {
+    if (!in_tree(heap, node))
+        return INACTIVE;
+
+    return (heap->tree[node / 32] >> (node % 32 * 2)) & 0b11;
 }
 
-void set_status(uint8_t* node, uint8_t status) {
-    *node = (*node & 0b1100) + (status & 0b11);
+uint8_t zeroed(struct Heap* heap, uint64_t node) {
+    if (!in_tree(heap, node))
+        return 0;
+
+    return (zero_bits(heap)[node / 64] >> (node % 64)) & 0b1;
 }
 
-void set_backup(uint8_t* node, uint8_t status) {
-    *node = (*node & 0b0011) + ((status & 0b11) << 2);
+void set_status(struct Heap* heap, uint64_t node, uint8_t status) {
+    uint64_t* word = &heap->tree[node / 32];
+    uint8_t shift = node % 32 * 2;
+
+    // keep count of the free nodes on each level
+    if (((*word >> shift) & 0b11) == FREE)
+        heap->frees[depth(node)]--;
+    if (status == FREE)
+        heap->frees[depth(node)]++;
+
+    *word &= ~((uint64_t) 0b11 << shift);
+    *word |= (uint64_t) (status & 0b11) << shift;
+}
+
+void set_zeroed(struct Heap* heap, uint64_t node, uint8_t zeroed) {
+    uint64_t* word = &zero_bits(heap)[node / 64];
+
+    *word &= ~((uint64_t) 1 << (node % 64));
+    *word |= (uint64_t) (zeroed & 0b1) << (node % 64);
+}
+
+uint8_t tail(struct Heap* heap, uint64_t node) {
+    return status(heap, node) == ALLOC && zeroed(heap, node);
+}
+
+void set_tail(struct Heap* heap, uint64_t node, uint8_t tail) {
+    // allocated nodes are never known zero, so the bit is free to use
+    set_zeroed(heap, node, tail);
 }
 
 
 // NODE RELATIONSHIPS
 
-uint8_t* node_parent(struct Heap* heap, uint8_t* node) {
-    void* ptr = &heap->root + ((node - &heap->root) - 1) / 2;
-    return (in_tree(heap, ptr)) ? ptr : NULL;
+uint64_t node_parent(struct Heap* heap, uint64_t node) {
+    uint64_t parent = node / 2;
+    return (in_tree(heap, parent)) ? parent : 0;
 }
 
-uint8_t* node_left(struct Heap* heap, uint8_t* node) {
-    void* ptr = &heap->root + (2 * (node - &heap->root) + 1);
-    return (in_tree(heap, ptr)) ? ptr : NULL;
+uint64_t node_left(struct Heap* heap, uint64_t node) {
+    uint64_t left = 2 * node;
+    return (in_tree(heap, left)) ? left : 0;
 }
 
-uint8_t* node_right(struct Heap* heap, uint8_t* node) {
-    void* ptr = &heap->root + (2 * (node - &heap->root) + 2);
-    return (in_tree(heap, ptr)) ? ptr : NULL;
+uint64_t node_right(struct Heap* heap, uint64_t node) {
+    uint64_t right = 2 * node + 1;
+    return (in_tree(heap, right)) ? right : 0;
 }
 
 
 // INTERNAL AND EXTERNAL ADDRESSING
 
-int64_t node_to_address(uint8_t* node, struct Parcel* parcel) {
-    struct Heap* heap = parcel->heap;
-    uint8_t* target = parcel->target;
+int64_t node_to_address(struct Heap* heap, uint64_t node) {
+    if (!in_tree(heap, node))
+        return -1;
 
-    if ((status(node) == ALLOC || status(node) == FREE)
-            && in_tree(heap, node)) {
-        if (node == target) {
-            return parcel->bytes;
-        } else {
-            parcel->bytes += (1 << node_size(heap, node));
-        }
-    } else if (is_valid(heap, node)) {
-        int64_t left = node_to_address(node_left(heap, node), parcel);
-        int64_t right = node_to_address(node_right(heap, node), parcel);
-        return (left > right) ? left : right;
+    // position of the node among the nodes of the same size
+    uint64_t position = node - ((uint64_t) 1 << depth(node));
+    return position << node_size(heap, node);
+}
+
+uint64_t address_to_node(struct Heap* heap, int64_t offset) {
+    uint64_t node = locate_node(heap, offset);
+    return (node && node_to_address(heap, node) == offset) ? node : 0;
+}
+
+uint64_t locate_node(struct Heap* heap, int64_t offset) {
+    uint64_t node = ROOT;
+    uint8_t size = heap->cur_size;
+
+    if (offset < 0 || offset >= heap->limit)
+        return 0;
+
+    while (status(heap, node) == PARENT) {
+        size--;
+        node = 2 * node + ((offset >> size) & 1);
     }
 
-    return -1;
+    return (is_valid(heap, node)) ? node : 0;
 }
 
-uint8_t* address_to_node(uint8_t* node, struct Parcel* parcel) {
-    struct Heap* heap = parcel->heap;
-    int64_t target = *((int64_t*) parcel->target);
+uint64_t level_node(struct Heap* heap, int64_t offset, uint8_t size) {
+    if (size < heap->min_size || size > heap->cur_size)
+        return 0;
 
-    if ((status(node) == ALLOC || status(node) == FREE)
-            && in_tree(heap, node)) {
-        if (parcel->bytes == target) {
-            return node;
-        } else {
-            parcel->bytes += (1 << node_size(heap, node));
-        }
-    } else if (is_valid(heap, node)) {
-        uint8_t* left = address_to_node(node_left(heap, node), parcel);
-        uint8_t* right = address_to_node(node_right(heap, node), parcel);
-        return (left) ? left : right;
+    if (offset < 0 || offset >= heap->limit
+            || offset & (((int64_t) 1 << size) - 1))
+        return 0;
+
+    // nodes of one size are stored in order after all larger nodes
+    uint64_t level = (uint64_t) 1 << (heap->cur_size - size);
+    return level + (offset >> size);
+}
+
+uint64_t scan_level(struct Heap* heap, uint64_t first, uint64_t last) {
+    uint64_t node = first;
+
+    while (node < last) {
+        uint64_t base = node - node % 32;
+        uint64_t word = heap->tree[node / 32];
+
+        // a free node has its low bit set and its high bit clear
+        uint64_t match = word & ~(word >> 1) & LOW_BITS;
+        match &= ~(uint64_t) 0 << (node % 32 * 2);
+        if (last - base < 32)
+            match &= ((uint64_t) 1 << ((last - base) * 2)) - 1;
+
+        if (match)
+            return base + __builtin_ctzll(match) / 2;
+
+        node = base + 32;
     }
 
-    return NULL;
+    return 0;
 }
 
-uint8_t* find_node(struct Heap* heap, uint8_t* node, int8_t target_size) {
-    if (!is_valid(heap, node))
-        return NULL;
+uint64_t find_node(struct Heap* heap, uint64_t node, int8_t target_size) {
+    if (!is_valid(heap, node) || target_size < heap->min_size
+            || target_size > node_size(heap, node))
+        return 0;
 
-    if (status(node) == FREE && node_size(heap, node) == target_size) {
-        return node;
-    } else {
-        uint8_t* left = find_node(heap, node_left(heap, node), target_size);
-        uint8_t* right = find_node(heap, node_right(heap, node), target_size);
-        return (left) ? left : right;
+    uint8_t level = heap->cur_size - target_size;
+    if (heap->frees[level] == 0)
+        return 0;
+
+    // descendants of a node on one level are stored together
+    uint8_t shift = level - depth(node);
+    return scan_level(heap, node << shift, (node + 1) << shift);
+}
+
+uint64_t scan_reverse(struct Heap* heap, uint64_t first, uint64_t last) {
+    uint64_t node = last;
+
+    while (node > first) {
+        uint64_t base = (node - 1) - (node - 1) % 32;
+        uint64_t word = heap->tree[base / 32];
+
+        // a free node has its low bit set and its high bit clear
+        uint64_t match = word & ~(word >> 1) & LOW_BITS;
+        if (node - base < 32)
+            match &= ((uint64_t) 1 << ((node - base) * 2)) - 1;
+        if (first > base)
+            match &= ~(uint64_t) 0 << ((first - base) * 2);
+
+        if (match)
+            return base + (63 - __builtin_clzll(match)) / 2;
+
+        node = base;
+    }
+
+    return 0;
+}
+
+uint64_t find_last(struct Heap* heap, uint64_t node, int8_t target_size) {
+    if (!is_valid(heap, node) || target_size < heap->min_size
+            || target_size > node_size(heap, node))
+        return 0;
+
+    uint8_t level = heap->cur_size - target_size;
+    if (heap->frees[level] == 0)
+        return 0;
+
+    uint8_t shift = level - depth(node);
+    return scan_reverse(heap, node << shift, (node + 1) << shift);
+}
+
+uint64_t dense_node(uint64_t node, int8_t target_size, struct Parcel* parcel) {
+    struct Heap* heap = parcel->heap;
+
+    if (!is_valid(heap, node) || status(heap, node) == ALLOC) {
+        return 0;
+    } else if (status(heap, node) == FREE) {
+        return (uint64_t) 1 << node_size(heap, node);
+    }
+
+    uint64_t left = node_left(heap, node);
+    uint64_t right = node_right(heap, node);
+    uint64_t left_free = dense_node(left, target_size, parcel);
+    uint64_t right_free = dense_node(right, target_size, parcel);
+
+    // score each candidate by the free memory left in its buddy
+    if (status(heap, left) == FREE && node_size(heap, left) == target_size
+            && right_free < parcel->bytes) {
+        parcel->bytes = right_free;
+        parcel->target = left;
     }
+    if (status(heap, right) == FREE && node_size(heap, right) == target_size
+            && left_free < parcel->bytes) {
+        parcel->bytes = left_free;
+        parcel->target = right;
+    }
+
+    return left_free + right_free;
+}
+
+uint64_t find_dense(struct Heap* heap, uint64_t node, int8_t target_size) {
+    // the word scan rules out subtrees and sizes without a candidate, so
+    // only a subtree which has one is walked
+    uint64_t first = find_node(heap, node, target_size);
+    if (!first || first == node)
+        return first;
+
+    struct Parcel parcel = { heap, UINT64_MAX, 0 };
+    dense_node(node, target_size, &parcel);
+    return parcel.target;
 }
 
 
 // MODIFY STRUCTURE
 
-void backup_tree(struct Heap* heap, uint8_t* node) {
+void clear_tree(struct Heap* heap) {
+    // every node below the deepest level is already inactive
+    uint64_t nodes = (uint64_t) 2 << heap->deepest;
+    memset(heap->tree, 0, (nodes + 31) / 32 * sizeof(uint64_t));
+    memset(zero_bits(heap), 0, (nodes + 63) / 64 * sizeof(uint64_t));
+    memset(heap->frees, 0, (heap->deepest + 1) * sizeof(uint64_t));
+
+    heap->deepest = 0;
+    heap->tails = 0;
+    set_status(heap, ROOT, FREE);
+
+    // split off the largest buddies which lie wholly beyond the limit
+    uint64_t node = ROOT;
+    uint64_t bytes = heap->limit;
+    while (bytes < ((uint64_t) 1 << node_size(heap, node))) {
+        if (bytes == 0) {
+            set_status(heap, node, ALLOC);
+            break;
+        }
+
+        uint64_t half = (uint64_t) 1 << (node_size(heap, node) - 1);
+        split_node(heap, node, node_size(heap, node) - 1);
+
+        if (bytes >= half) {
+            bytes -= half;
+            node = node_right(heap, node);
+        } else {
+            set_status(heap, node_right(heap, node), ALLOC);
+            node = node_left(heap, node);
+        }
+    }
+}
+
+void zero_tree(struct Heap* heap, uint64_t node) {
     if (is_valid(heap, node)) {
-        set_backup(node, status(node));
+        if (status(heap, node) == FREE)
+            set_zeroed(heap, node, 1);
 
-        backup_tree(heap, node_left(heap, node));
-        backup_tree(heap, node_right(heap, node));
+        zero_tree(heap, node_left(heap, node));
+        zero_tree(heap, node_right(heap, node));
     }
 }
 
-void restore_tree(struct Heap* heap, uint8_t* node) {
-    if (in_tree(heap, node) && backup(node) > 0) {
-        set_status(node, backup(node));
-        set_backup(node, 0);
+uint64_t split_branch(struct Heap* heap, uint64_t node, uint8_t size, int last) {
+    int curr = node_size(heap, node);
+    while (curr > size && curr > heap->min_size) {
+        uint64_t right = node_right(heap, node);
+        uint64_t left = node_left(heap, node);
+
+        // a repair only recounts levels down to the deepest, so the new
+        // level is counted before any of its nodes become free
+        if (depth(left) > heap->deepest)
+            heap->deepest = depth(left);
+
+        // update parent and child status
+        set_status(heap, right, FREE);
+        set_status(heap, left, FREE);
+        set_status(heap, node, PARENT);
 
-        restore_tree(heap, node_left(heap, node));
-        restore_tree(heap, node_right(heap, node));
+        set_zeroed(heap, right, zeroed(heap, node));
+        set_zeroed(heap, left, zeroed(heap, node));
+
+        node = (last) ? right : left;
+        curr--;
     }
+
+    return node;
+}
+
+uint64_t split_node(struct Heap* heap, uint64_t node, uint8_t size) {
+    return split_branch(heap, node, size, 0);
+}
+
+uint64_t split_last(struct Heap* heap, uint64_t node, uint8_t size) {
+    return split_branch(heap, node, size, 1);
 }
 
-void grow_tree(struct Heap* heap, uint8_t size) {
-    uint8_t* node = find_node(heap, &heap->root, size);
-    int i = 0;
-    while (!node && size + i <= heap->cur_size) {
-        node = find_node(heap, &heap->root, size + i++);
+uint64_t claim_node(struct Heap* heap, int64_t offset, uint8_t size) {
+    uint64_t node = locate_node(heap, offset);
+
+    if (status(heap, node) != FREE || size < heap->min_size
+            || node_size(heap, node) < size
+            || offset & (((int64_t) 1 << size) - 1))
+        return 0;
+
+    // split towards the offset until the block is of 'size'
+    while (node_size(heap, node) > size) {
+        split_node(heap, node, node_size(heap, node) - 1);
+        node = locate_node(heap, offset);
     }
 
-    if (node != NULL) {
-        int curr = node_size(heap, node);
-        if (curr > size && curr > heap->min_size) {
-            // update parent and child status
-            set_status(node_right(heap, node), FREE);
-            set_status(node_left(heap, node), FREE);
-            set_status(node, PARENT);
+    set_status(heap, node, ALLOC);
+    set_zeroed(heap, node, 0);
+    return node;
+}
 
-            grow_tree(heap, size);
+uint64_t trim_node(struct Heap* heap, uint64_t node, uint64_t bytes) {
+    uint64_t min_bytes = (uint64_t) 1 << heap->min_size;
+    bytes = (bytes < min_bytes) ? min_bytes : (bytes + min_bytes - 1) & ~(min_bytes - 1);
+
+    uint64_t head = 0;
+    while (bytes < ((uint64_t) 1 << node_size(heap, node))) {
+        uint64_t half = (uint64_t) 1 << (node_size(heap, node) - 1);
+        split_node(heap, node, node_size(heap, node) - 1);
+
+        if (bytes > half) {
+            // the left half is used whole and the rest taken from the right
+            uint64_t left = node_left(heap, node);
+            set_status(heap, left, ALLOC);
+            set_tail(heap, left, head != 0);
+            heap->tails += (head != 0);
+            head = (head) ? head : left;
+
+            bytes -= half;
+            node = node_right(heap, node);
+        } else {
+            node = node_left(heap, node);
         }
     }
+
+    set_status(heap, node, ALLOC);
+    set_tail(heap, node, head != 0);
+    heap->tails += (head != 0);
+    return (head) ? head : node;
+}
+
+void deactivate_node(struct Heap* heap, uint64_t node) {
+    if (!in_tree(heap, node) || status(heap, node) == INACTIVE)
+        return;
+
+    set_status(heap, node, INACTIVE);
+    deactivate_node(heap, node_left(heap, node));
+    deactivate_node(heap, node_right(heap, node));
+}
+
+void repair_node(struct Heap* heap, uint64_t node) {
+    uint64_t right = node_right(heap, node);
+    uint64_t left = node_left(heap, node);
+
+    if (!left || !right)
+        return;
+
+    if (status(heap, node) == PARENT) {
+        // a split may have stopped before both children were freed
+        if (status(heap, left) == INACTIVE)
+            set_status(heap, left, FREE);
+        if (status(heap, right) == INACTIVE)
+            set_status(heap, right, FREE);
+
+        repair_node(heap, left);
+        repair_node(heap, right);
+    } else {
+        // a merge may have stopped before the children were cleared
+        deactivate_node(heap, left);
+        deactivate_node(heap, right);
+    }
+}
+
+void repair_tree(struct Heap* heap) {
+    repair_node(heap, ROOT);
+
+    // a count may have been left between its two updates
+    memset(heap->frees, 0, sizeof(heap->frees));
+    heap->tails = 0;
+    for (uint64_t node = ROOT; node < ((uint64_t) 2 << heap->deepest); node++) {
+        if (status(heap, node) == FREE)
+            heap->frees[depth(node)]++;
+        heap->tails += tail(heap, node);
+    }
+}
+
+void join_node(struct Heap* heap, uint64_t node) {
+    uint64_t left = node * 2;
+    uint64_t right = left + 1;
+
+    set_status(heap, node, FREE);
+    set_zeroed(heap, node, zeroed(heap, left) && zeroed(heap, right));
+    set_status(heap, left, INACTIVE);
+    set_status(heap, right, INACTIVE);
 }
 
-void prune_tree(struct Heap* heap, uint8_t* node) {
-    uint8_t* right = node_right(heap, node);
-    uint8_t* left = node_left(heap, node);
+void prune_tree(struct Heap* heap, uint64_t node) {
+    uint64_t right = node_right(heap, node);
+    uint64_t left = node_left(heap, node);
 
     if (is_valid(heap, left) && is_valid(heap, right)) {
         prune_tree(heap, left);
         prune_tree(heap, right);
 
-        if (status(left) == 1 && status(right) == 1) {
-            set_status(node, FREE);
-            set_status(left, INACTIVE);
-            set_status(right, INACTIVE);
-        }
+        if (status(heap, left) == FREE && status(heap, right) == FREE)
+            join_node(heap, node);
+    }
+}
+
+uint64_t merge_node(struct Heap* heap, uint64_t node) {
+    // only the freed node's own buddy can have become mergeable, and
+    // after each merge only the parent's
+    while (node > ROOT && status(heap, node) == FREE
+            && status(heap, node ^ 1) == FREE) {
+        node = node / 2;
+        join_node(heap, node);
+    }
+
+    return node;
+}
+
+void merge_level(struct Heap* heap, uint8_t level) {
+    uint64_t last = (uint64_t) 2 << level;
+    uint64_t node = scan_level(heap, (uint64_t) 1 << level, last);
+
+    while (node && heap->frees[level] > 1) {
+        if (!(node & 1) && status(heap, node ^ 1) == FREE)
+            join_node(heap, node / 2);
+
+        // a left node's buddy is either merged or not free
+        node = scan_level(heap, (node | 1) + 1, last);
     }
 }
@@ -1,20 +1,219 @@
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 
 // DATA STRUCTURE AND REPRESENTATION
 
+/**
+ * Number of movable allocations a heap can track at once.
+ */
+#define HANDLES 32
+
+/**
+ * Number of block sizes, and blocks of each size, which can be held
+ * unmerged in the quick lists of a heap.
+ */
+#define QUICK_ORDERS 32
+#define QUICK_DEPTH 8
+
+/**
+ * Number of sampled allocations a heap can track at once, and the most
+ * stack frames recorded for each of them.
+ */
+#define SAMPLES 256
+#define SAMPLE_DEPTH 16
+
+/**
+ * Most blocks which can be reserved ahead of a burst of requests.
+ */
+#define RESERVED 64
+
+/**
+ * Most readers which can be inside an epoch at once, most blocks which
+ * can await reclamation, and how many retired blocks trigger an
+ * attempt to release them.
+ */
+#define READERS 64
+#define RETIRED 64
+#define RETIRE_BATCH 16
+
+/**
+ * Number of large allocations mapped outside the tree which a heap
+ * can track at once.
+ */
+#define LARGE_OBJECTS 16
+
+/**
+ * Most levels a tree can have.
+ */
+#define LEVELS 64
+
+/**
+ * Nodes are numbered breadth first from the root, so that node n has
+ * the children 2n and 2n + 1. Node 0 does not exist and is returned
+ * wherever there is no node.
+ */
+#define ROOT 1
+
+/**
+ * Recently freed blocks of one size, stored as node indices, which
+ * are reused before their buddies are merged.
+ */
+struct Quick {
+    uint8_t count;
+    uint32_t nodes[QUICK_DEPTH];
+};
+
+/**
+ * Movable allocation, referred to by its index in the heap. The
+ * block may be relocated during compaction while it is not pinned.
+ */
+struct Handle {
+    int64_t offset;
+    uint8_t used;
+    uint8_t pins;
+};
+
+/**
+ * Blocks of one size which are split and faulted in ahead of a burst
+ * of requests, held allocated until they are handed out.
+ */
+struct Reserve {
+    uint8_t size;
+    uint32_t count;
+    uint64_t nodes[RESERVED];
+};
+
+/**
+ * Block freed while readers may still hold it, with the epoch it was
+ * retired in. It is released once every reader has left that epoch.
+ */
+struct Retired {
+    int64_t offset;
+    uint64_t epoch;
+};
+
+/**
+ * Epoch each reader entered in, zero for unused slots, and the blocks
+ * retired until no reader can hold them.
+ */
+struct Epochs {
+    uint64_t readers[READERS];
+    struct Retired retire[RETIRED];
+};
+
+/**
+ * Allocation at or above the large threshold, given its own mapping
+ * of whole pages instead of a block of the tree.
+ */
+struct Large {
+    void* address;
+    uint64_t length;
+};
+
+/**
+ * Live allocation picked by the sampling profiler, with the call stack
+ * which requested it. Entries of zero bytes are unused.
+ */
+struct Sample {
+    int64_t offset;
+    uint32_t bytes;
+    uint32_t depth;
+    void* frames[SAMPLE_DEPTH];
+};
+
 /**
  * Buddy allocation data structure, storing information on
- * the size of the heap and the root of the tree which
- * represents the layout of the the memory structure.
+ * the size of the heap and the tree which represents the
+ * layout of the the memory structure.
+ *
+ * The tree is packed two bits per node, 32 nodes to a word,
+ * followed by a bitmap of which free nodes are known zero. For
+ * allocated nodes the same bit marks a tail piece of a trimmed block.
+ *
+ * A heap whose size is not a power of two is the left part of a tree
+ * of the next power of two, with the rest held by allocated nodes
+ * beyond the limit. Its free memory is then a forest of buddy trees
+ * of decreasing size, searched together level by level.
+ *
+ * The tables of optional features are mapped outside the heap when the
+ * feature is first used, so that small heaps stay small. They are
+ * private to the process, so a shared heap cannot use those features.
  */
 struct Heap {
     // information about heap
     uint8_t min_size;
     uint8_t cur_size;
 
+    // bytes of storage, beyond which the tree is permanently reserved
+    uint64_t limit;
+
+    // deepest level of the tree any node has been split into
+    uint8_t deepest;
+
+    // offset from the heap to the start of its memory storage
+    int64_t storage;
+
+    // allocation configuration
+    uint8_t policy;
+    uint8_t deferred;
+    uint8_t purge;
+    uint8_t trim;
+    uint8_t shared;
+
+    // offset of the block the next slice of purging starts from
+    int64_t purged;
+
+    // maintenance worker and the lock it shares with callers, and the
+    // level it merges next while the tree is dirty
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t worker;
+    uint8_t locking;
+    uint8_t running;
+    uint8_t dirty;
+    uint8_t sweep;
+    uint32_t period;
+    uint32_t budget;
+
+    // offset plus one of the last block freed by another thread
+    uint64_t remote;
+
+    // current epoch, and the readers and retired blocks, whose table is
+    // mapped by the first reader or retired block
+    uint64_t epoch;
+    uint32_t retired;
+    struct Epochs* epochs;
+
+    // blocks prepared for the next requests of one size, mapped by the
+    // first reservation
+    struct Reserve* reserve;
+
+    // freed blocks awaiting coalescing, mapped while freeing is deferred
+    struct Quick* quick;
+
+    // sampling profiler, whose table is mapped on the first sample
+    uint64_t sample_rate;
+    int64_t sample_next;
+    struct Sample* samples;
+
+    // allocations mapped outside the tree, whose table is mapped while
+    // there is a threshold or any of them remain
+    uint64_t large_min;
+    uint8_t larges;
+    struct Large* large;
+
+    // movable allocations, mapped by the first handle
+    struct Handle* handles;
+
+    // number of free nodes on each level of the tree
+    uint64_t frees[LEVELS];
+
+    // number of allocated tail pieces of trimmed blocks
+    uint64_t tails;
+
     // buddy data structure
-    uint8_t root;
+    uint64_t tree[];
 };
 
 
@@ -27,6 +226,13 @@ struct Heap {
  */
 uint64_t overhead(struct Heap* heap);
 
+/**
+ * Returns the start of the memory storage. This directly follows
+ * the buddy data structure, unless the heap was carved out of
+ * another heap.
+ */
+void* heap_storage(struct Heap* heap);
+
 
 // NODE VERIFICATION
 
@@ -34,14 +240,14 @@ uint64_t overhead(struct Heap* heap);
  * Returns whether a given node is in the 'tree' of the buddy
  * allocation algorithm.
  */
-int in_tree(struct Heap* heap, uint8_t* node);
+int in_tree(struct Heap* heap, uint64_t node);
 
 /**
  * Returns if the node's value is greater than zero, i.e it is
  * an active node, and whether it is in the tree. Functionally
  * is used as a stricter version of in_tree.
  */
-int is_valid(struct Heap* heap, uint8_t* node);
+int is_valid(struct Heap* heap, uint64_t node);
 
 
 // NODE DATA
@@ -50,7 +256,7 @@ int is_valid(struct Heap* heap, uint8_t* node);
  * Returns a the size, in bytes, of the supplied arguement
  * node based on the depth of the node in the tree.
  */
-uint64_t node_size(struct Heap* heap, uint8_t* node);
+uint64_t node_size(struct Heap* heap, uint64_t node);
 
 /**
  * Describes the status of a node using its value.
@@ -63,45 +269,57 @@ enum status {
 };
 
 /**
- * Returns the status stored in the first and second bit.
+ * Returns the status stored in the node's two bits of the tree.
  */
-uint8_t status(uint8_t* node);
+uint8_t status(struct Heap* heap, uint64_t node);
 
 /**
- * Returns the backup stored in third and fourth bit.
+ * Returns whether the block of a free node is known to contain only
+ * zeros.
  */
-uint8_t backup(uint8_t* node);
+uint8_t zeroed(struct Heap* heap, uint64_t node);
 
 /**
  * Sets the node's status.
  */
-void set_status(uint8_t* node, uint8_t status);
+void set_status(struct Heap* heap, uint64_t node, uint8_t status);
+
+/**
+ * Sets whether the node's block is known to contain only zeros.
+ */
+void set_zeroed(struct Heap* heap, uint64_t node, uint8_t zeroed);
+
+/**
+ * Returns whether an allocated node is a tail piece, which continues
+ * the trimmed block ending just before it.
+ */
+uint8_t tail(struct Heap* heap, uint64_t node);
 
 /**
- * Sets the node's backup.
+ * Sets whether an allocated node is a tail piece.
  */
-void set_backup(uint8_t* node, uint8_t status);
+void set_tail(struct Heap* heap, uint64_t node, uint8_t tail);
 
 
 // NODE RELATIONSHIPS
 
 /**
- * Returns a pointer to the parent node of the supplied arguement
- * node if it exists.
+ * Returns the parent node of the supplied arguement node if it
+ * exists.
  */
-uint8_t* node_parent(struct Heap* heap, uint8_t* node);
+uint64_t node_parent(struct Heap* heap, uint64_t node);
 
 /**
- * Returns a pointer to the left child node of the supplied
- * arguement node if it exists.
+ * Returns the left child node of the supplied arguement node if
+ * it exists.
  */
-uint8_t* node_left(struct Heap* heap, uint8_t* node);
+uint64_t node_left(struct Heap* heap, uint64_t node);
 
 /**
- * Returns a pointer to the right child node of the supplied
- * arguement node if it exists.
+ * Returns the right child node of the supplied arguement node if
+ * it exists.
  */
-uint8_t* node_right(struct Heap* heap, uint8_t* node);
+uint64_t node_right(struct Heap* heap, uint64_t node);
 
 
 // INTERNAL AND EXTERNAL ADDRESSING
@@ -112,48 +330,126 @@ uint8_t* node_right(struct Heap* heap, uint8_t* node);
 struct Parcel {
     struct Heap* heap;
     uint64_t bytes;
-    void* target;
+    uint64_t target;
 };
 
 /**
  * Returns the offset from the start of the memory storage in
  * bytes for a given node in the layout 'tree'.
  */
-int64_t node_to_address(uint8_t* node, struct Parcel* parcel);
+int64_t node_to_address(struct Heap* heap, uint64_t node);
+
+/**
+ * Returns the allocated or free node from the layout 'tree' whose
+ * block starts at a specific byte offset.
+ */
+uint64_t address_to_node(struct Heap* heap, int64_t offset);
+
+/**
+ * Returns the leaf node, allocated or free, whose block contains the
+ * given byte offset by descending from the root. Offsets beyond the
+ * limit have no node.
+ */
+uint64_t locate_node(struct Heap* heap, int64_t offset);
 
 /**
- * Returns the associated 'node' from the layout 'tree' using
- * a specific byte offset.
+ * Returns the node of a given 'size' whose block starts at the given
+ * byte offset, computed directly from its position in the tree.
  */
-uint8_t* address_to_node(uint8_t* node, struct Parcel* parcel);
+uint64_t level_node(struct Heap* heap, int64_t offset, uint8_t size);
 
 /**
- * Returns a pointer to the leftmost node in the tree of target_size.
+ * Returns the leftmost free node of target_size below 'node',
+ * scanning the nodes of that size a word at a time.
  */
-uint8_t* find_node(struct Heap* heap, uint8_t* node, int8_t target_size);
+uint64_t find_node(struct Heap* heap, uint64_t node, int8_t target_size);
+
+/**
+ * Returns the rightmost free node of target_size below 'node',
+ * scanning the nodes of that size a word at a time from the end.
+ */
+uint64_t find_last(struct Heap* heap, uint64_t node, int8_t target_size);
+
+/**
+ * Returns the free node of target_size below 'node' whose buddy
+ * subtree has the least free memory, so that using it breaks up
+ * as few otherwise mergeable blocks as possible.
+ */
+uint64_t find_dense(struct Heap* heap, uint64_t node, int8_t target_size);
 
 
 // MODIFY STRUCTURE
 
 /**
- * Sets the backup of each node to the current status.
+ * Resets the tree to a single free root, clearing only the levels
+ * which have been split into since the tree was last cleared. The
+ * memory beyond the limit is then reserved by allocated nodes.
+ */
+void clear_tree(struct Heap* heap);
+
+/**
+ * Marks the block of every free node as known to contain only zeros.
+ */
+void zero_tree(struct Heap* heap, uint64_t node);
+
+/**
+ * Splits a free node down its leftmost branch until it is of the
+ * given 'size', returning the resulting free node. Children inherit
+ * whether their parent was known to be zeroed.
+ */
+uint64_t split_node(struct Heap* heap, uint64_t node, uint8_t size);
+
+/**
+ * Splits a free node down its rightmost branch until it is of the
+ * given 'size', returning the resulting free node.
  */
-void backup_tree(struct Heap* heap, uint8_t* node);
+uint64_t split_last(struct Heap* heap, uint64_t node, uint8_t size);
 
 /**
- * Sets the status of each node to the backup and resets the backup.
+ * Allocates the block of 'size' at a byte offset which lies within
+ * free memory, splitting the free node around it as needed. Returns
+ * the allocated node, or 0 if the block is not free.
  */
-void restore_tree(struct Heap* heap, uint8_t* node);
+uint64_t claim_node(struct Heap* heap, int64_t offset, uint8_t size);
 
 /**
- * Grows the tree to a given 'size' by recursively splitting
- * nodes until an un-allocated node of 'size' is available.
+ * Allocates the start of a free node as contiguous pieces which hold
+ * 'bytes', leaving the trailing buddies free. Every piece after the
+ * first is marked as a tail. Returns the first piece.
  */
-void grow_tree(struct Heap* heap, uint8_t size);
+uint64_t trim_node(struct Heap* heap, uint64_t node, uint64_t bytes);
+
+/**
+ * Restores the invariants of a tree whose update was cut short, by
+ * activating the missing children of parents, deactivating everything
+ * below leaves and recounting the free nodes and tail pieces.
+ */
+void repair_tree(struct Heap* heap);
 
 /**
  * If a node has two children which are both un-allocated, then
  * collapse that node. This is peformed recursively throughout
- * the entire tree from the root.
+ * the entire tree from the root. The merged node is zeroed only if
+ * both of its children were.
+ */
+void prune_tree(struct Heap* heap, uint64_t node);
+
+/**
+ * Collapses a parent whose two children are free into a single free
+ * node, which is zeroed only if both of its children were.
+ */
+void join_node(struct Heap* heap, uint64_t node);
+
+/**
+ * Merges a free node with its free buddy, and the result with its own,
+ * up the tree for as long as they are free. Returns the largest node
+ * the block became part of.
+ */
+uint64_t merge_node(struct Heap* heap, uint64_t node);
+
+/**
+ * Collapses every pair of free buddies on one level of the tree into
+ * their parent, scanning the level a word at a time. Merging each level
+ * from the deepest up gives the same tree as prune_tree.
  */
-void prune_tree(struct Heap* heap, uint8_t* node);
+void merge_level(struct Heap* heap, uint8_t level);
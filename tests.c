@@ -2,6 +2,9 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "virtual_sbrk.h"
 #include "structure.h"
@@ -24,20 +27,19 @@ void* virtual_sbrk(int32_t increment) {
 
 // HELPER FUNCTIONS
 
-void address_tree(struct Heap* heap, uint8_t* node, char* prefix, int last) {
+void address_tree(struct Heap* heap, uint64_t node, char* prefix, int last) {
     if (is_valid(heap, node)) {
         char* current_prefix = (last ? "└─ " : "├─ ");
         char* child_prefix = (last ? "   " : "|  ");
         
-        if (status(node) == ALLOC || status(node) == FREE) {
-            struct Parcel parcel = { heap, 0, node };
+        if (status(heap, node) == ALLOC || status(heap, node) == FREE) {
             printf("%s%s(%d) %s %d -> %d\n",
                 prefix,
                 current_prefix,
                 (int) node_size(heap, node),
-                (status(node) == ALLOC ? "allocated" : "free"),
+                (status(heap, node) == ALLOC ? "allocated" : "free"),
                 (int) 1 << node_size(heap, node),
-                (int) node_to_address(&heap->root, &parcel)
+                (int) node_to_address(heap, node)
             );
         } else {
             printf("%s%s%d\n",
@@ -58,24 +60,23 @@ void address_tree(struct Heap* heap, uint8_t* node, char* prefix, int last) {
     }
 }
 
-void version_tree(struct Heap* heap, uint8_t* node, char* prefix, int last) {
-    if (in_tree(heap, node) && (status(node) > 0 || backup(node) > 0)) {
+void status_tree(struct Heap* heap, uint64_t node, char* prefix, int last) {
+    if (is_valid(heap, node)) {
         char* current_prefix = (last ? "└─ " : "├─ ");
         char* child_prefix = (last ? "   " : "|  ");
         
-        printf("%s%s%d -> %d\n",
+        printf("%s%s%d\n",
             prefix,
             current_prefix,
-            status(node),
-            backup(node)
+            status(heap, node)
         );
 
         char* new_prefix = malloc(100 * sizeof(char));
         strcpy(new_prefix, prefix);
         strcat(new_prefix, child_prefix);
 
-        version_tree(heap, node_left(heap, node), new_prefix, 0);
-        version_tree(heap, node_right(heap, node), new_prefix, 1);
+        status_tree(heap, node_left(heap, node), new_prefix, 0);
+        status_tree(heap, node_right(heap, node), new_prefix, 1);
 
         free(new_prefix);
     }
@@ -117,10 +118,10 @@ int assert_virtual_info(char* expected) {
     return assert_temp_file(expected);
 }
 
-int assert_version_tree(char* expected) {
+int assert_status_tree(char* expected) {
     struct Heap* heap = virtual_heap;
     freopen("output_testing", "w", stdout);
-    version_tree(heap, &heap->root, "", 1);
+    status_tree(heap, ROOT, "", 1);
     freopen("/dev/tty", "w", stdout);
     return assert_temp_file(expected);
 }
@@ -323,6 +324,300 @@ void malloc_complex() {
     ));
 }
 
+void malloc_policies() {
+    printf("Can follow placement policies...\n");
+    struct Heap* heap = virtual_heap;
+    program_break = virtual_heap;
+
+    init_allocator(virtual_heap, 10, 7);
+    void* storage = virtual_heap + overhead(heap);
+
+    // free 256 blocks at 256, beside a free 128, and at 768
+    virtual_malloc(virtual_heap, 128);
+    void* spare = virtual_malloc(virtual_heap, 256);
+    virtual_malloc(virtual_heap, 256);
+    virtual_free(virtual_heap, spare);
+
+    assert(virtual_malloc(virtual_heap, 256) == storage + 256);
+    virtual_free(virtual_heap, storage + 256);
+
+    assert(virtual_config(virtual_heap, OPT_POLICY, SPLIT_MIN) == 0);
+    assert(virtual_malloc(virtual_heap, 256) == storage + 768);
+    assert(find_dense(heap, ROOT, 9) == 0);
+    assert(node_to_address(heap, find_dense(heap, ROOT, 8)) == 256);
+    assert(virtual_config(virtual_heap, OPT_POLICY, 7) != 0);
+}
+
+void malloc_near() {
+    printf("Can place near a hint...\n");
+    struct Heap* heap = virtual_heap;
+    program_break = virtual_heap;
+
+    init_allocator(virtual_heap, 10, 7);
+    void* storage = virtual_heap + overhead(heap);
+
+    // free 128 blocks at 128 and at 640, beside the hint
+    virtual_malloc(virtual_heap, 128);
+    void* spare = virtual_malloc(virtual_heap, 128);
+    virtual_malloc(virtual_heap, 256);
+    void* hint = virtual_malloc(virtual_heap, 128);
+    virtual_free(virtual_heap, spare);
+
+    assert(hint == storage + 512);
+    assert(virtual_malloc_near(virtual_heap, 128, hint) == storage + 640);
+    assert(virtual_malloc_near(virtual_heap, 128, NULL) == storage + 128);
+    assert(virtual_malloc_near(virtual_heap, 128, hint) == storage + 768);
+}
+
+void malloc_calloc() {
+    printf("Can zero only when needed...\n");
+    struct Heap* heap = virtual_heap;
+    program_break = virtual_heap;
+
+    init_allocator(virtual_heap, 10, 7);
+    unsigned char* storage = virtual_heap + overhead(heap);
+    memset(storage, 0xAB, 1024);
+
+    // only the requested bytes are cleared
+    unsigned char* block = virtual_calloc(virtual_heap, 10, 10);
+    assert(block == storage && block[0] == 0 && block[99] == 0);
+    assert(block[100] == 0xAB);
+    assert(virtual_free(virtual_heap, block) == 0);
+
+    memset(storage, 0, 1024);
+    assert(virtual_config(virtual_heap, OPT_ZEROED, 1) == 0);
+    virtual_malloc(virtual_heap, 512);
+
+    // a block known to be zero is not cleared again
+    storage[512] = 0xCD;
+    block = virtual_calloc(virtual_heap, 1, 512);
+    assert(block == storage + 512 && block[0] == 0xCD);
+
+    // but it is once it has been handed out
+    assert(virtual_free(virtual_heap, block) == 0);
+    block = virtual_calloc(virtual_heap, 1, 512);
+    assert(block == storage + 512 && block[0] == 0);
+
+    assert(!virtual_calloc(virtual_heap, 1 << 16, 1 << 16));
+}
+
+void malloc_subheap() {
+    printf("Can allocate from a sub heap...\n");
+    program_break = virtual_heap;
+
+    init_allocator(virtual_heap, 15, 7);
+    void* subheap = virtual_subheap(virtual_heap, 12, 7);
+    assert(subheap != NULL);
+    assert(virtual_subheap(virtual_heap, 16, 7) == NULL);
+
+    // the sub heap's storage is a block of exactly its size
+    struct Heap* heap = subheap;
+    void* block = virtual_malloc(subheap, 4096);
+    assert(block == heap_storage(heap));
+    assert(virtual_usable_size(virtual_heap, block) == 4096);
+    assert(virtual_malloc(subheap, 128) == NULL);
+    assert(virtual_free(subheap, block) == 0);
+
+    // the tables of optional features are only mapped once used
+    assert(overhead(heap) < 1024);
+    assert(heap->quick == NULL && heap->handles == NULL);
+    assert(virtual_config(subheap, OPT_DEFER, 1) == 0);
+    assert(virtual_halloc(subheap, 128) == 0);
+    assert(heap->quick != NULL && heap->handles != NULL);
+
+    assert(virtual_subheap_free(virtual_heap, subheap) == 0);
+    assert(assert_virtual_info("free 32768\n"));
+}
+
+void malloc_sampling() {
+    printf("Can sample allocations...\n");
+    program_break = virtual_heap;
+
+    init_allocator(virtual_heap, 10, 7);
+    assert(virtual_profile(virtual_heap, stdout, PROFILE_TEXT) != 0);
+    assert(virtual_config(virtual_heap, OPT_SAMPLE, 256) == 0);
+
+    // one block is sampled for every 256 bytes requested
+    void* first = virtual_malloc(virtual_heap, 128);
+    void* second = virtual_malloc(virtual_heap, 128);
+    virtual_malloc(virtual_heap, 200);
+
+    FILE* out = fopen("profile_testing", "w");
+    assert(virtual_profile(virtual_heap, out, PROFILE_PPROF) == 0);
+    fclose(out);
+
+    char line[256];
+    out = fopen("profile_testing", "r");
+    assert(fgets(line, sizeof(line), out) != NULL);
+    assert(strcmp(line, "heap profile: 1: 128 [1: 128] @ heap_v2/256\n") == 0);
+    fclose(out);
+
+    // freed blocks leave the profile
+    virtual_free(virtual_heap, first);
+    virtual_free(virtual_heap, second);
+    out = fopen("profile_testing", "w");
+    assert(virtual_profile(virtual_heap, out, PROFILE_TEXT) == 0);
+    assert(ftell(out) == 0);
+    fclose(out);
+
+    // mapped objects are sampled too, and followed when they move
+    assert(virtual_config(virtual_heap, OPT_LARGE, 4096) == 0);
+    void* large = virtual_malloc(virtual_heap, 5000);
+    large = virtual_realloc(virtual_heap, large, 100000);
+    out = fopen("profile_testing", "w");
+    assert(virtual_profile(virtual_heap, out, PROFILE_PPROF) == 0);
+    fclose(out);
+    out = fopen("profile_testing", "r");
+    assert(fgets(line, sizeof(line), out) != NULL);
+    assert(strcmp(line, "heap profile: 1: 100000 [1: 100000] @ heap_v2/256\n") == 0);
+    fclose(out);
+
+    virtual_free(virtual_heap, large);
+    out = fopen("profile_testing", "w");
+    assert(virtual_profile(virtual_heap, out, PROFILE_TEXT) == 0);
+    assert(ftell(out) == 0);
+    fclose(out);
+    remove("profile_testing");
+
+    assert(virtual_config(virtual_heap, OPT_LARGE, 0) == 0);
+    assert(virtual_config(virtual_heap, OPT_SAMPLE, 0) == 0);
+}
+
+void malloc_trimming() {
+    printf("Can trim unused buddies...\n");
+    struct Heap* heap = virtual_heap;
+    program_break = virtual_heap;
+
+    init_allocator(virtual_heap, 10, 7);
+    assert(virtual_config(virtual_heap, OPT_TRIM, 1) == 0);
+
+    // 300 bytes take 256 + 128 instead of 512
+    void* block = virtual_malloc(virtual_heap, 300);
+    assert(assert_virtual_info(
+        "allocated 256\n"
+        "allocated 128\n"
+        "free 128\n"
+        "free 512\n"
+    ));
+    assert(virtual_usable_size(virtual_heap, block) == 384);
+    assert(virtual_usable_size(virtual_heap, block + 256) == 0);
+    assert(virtual_malloc(virtual_heap, 128) == block + 384);
+
+    // the tail is freed and resized along with the block, never on its own
+    assert(virtual_free(virtual_heap, block + 256) != 0);
+    assert(virtual_realloc(virtual_heap, block + 256, 200) == NULL);
+    assert(heap->tails == 1);
+    assert(virtual_free(virtual_heap, block) == 0);
+    assert(assert_virtual_info(
+        "free 256\n"
+        "free 128\n"
+        "allocated 128\n"
+        "free 512\n"
+    ));
+    assert(virtual_free(virtual_heap, block + 384) == 0);
+    assert(assert_virtual_info("free 1024\n"));
+}
+
+void malloc_any_size() {
+    printf("Can use a heap of any size...\n");
+    struct Heap* heap = virtual_heap;
+    program_break = virtual_heap;
+
+    // the break of a heap past 2 GiB is moved in several steps
+    uint64_t bytes = (uint64_t) 24 << 30;
+    init_allocator_bytes(virtual_heap, bytes, 24);
+    assert(program_break - virtual_heap == overhead(heap) + 2 + bytes);
+
+    // 1450 bytes round down to 1024 + 256 + 128
+    program_break = virtual_heap;
+    init_allocator_bytes(virtual_heap, 1450, 7);
+    void* storage = virtual_heap + overhead(heap);
+    assert(assert_virtual_info(
+        "free 1024\n"
+        "free 256\n"
+        "free 128\n"
+    ));
+
+    assert(virtual_malloc(virtual_heap, 2048) == NULL);
+    assert(virtual_malloc(virtual_heap, 128) == storage + 1280);
+    assert(virtual_malloc(virtual_heap, 512) == storage);
+    assert(virtual_malloc(virtual_heap, 512) == storage + 512);
+    assert(virtual_malloc(virtual_heap, 256) == storage + 1024);
+    assert(virtual_malloc(virtual_heap, 128) == NULL);
+
+    // the memory beyond the heap can never be freed
+    assert(virtual_free(virtual_heap, storage + 1408) != 0);
+    assert(virtual_free(virtual_heap, storage + 1536) != 0);
+
+    virtual_reset(virtual_heap);
+    assert(assert_virtual_info(
+        "free 1024\n"
+        "free 256\n"
+        "free 128\n"
+    ));
+}
+
+void malloc_reserve() {
+    printf("Can reserve blocks ahead of requests...\n");
+    struct Heap* heap = virtual_heap;
+    program_break = virtual_heap;
+
+    init_allocator(virtual_heap, 10, 7);
+    void* storage = virtual_heap + overhead(heap);
+
+    assert(virtual_reserve(virtual_heap, 100, 3) == 3);
+    assert(assert_virtual_info(
+        "allocated 128\n"
+        "allocated 128\n"
+        "allocated 128\n"
+        "free 128\n"
+        "free 512\n"
+    ));
+
+    // other sizes are served around the reserved blocks
+    assert(virtual_malloc(virtual_heap, 256) == storage + 512);
+    assert(virtual_malloc(virtual_heap, 128) == storage + 256);
+    assert(virtual_malloc(virtual_heap, 128) == storage + 128);
+
+    assert(virtual_reserve(virtual_heap, 128, 0) == 0);
+    assert(assert_virtual_info(
+        "free 128\n"
+        "allocated 128\n"
+        "allocated 128\n"
+        "free 128\n"
+        "allocated 256\n"
+        "free 256\n"
+    ));
+    assert(virtual_reserve(virtual_heap, 2048, 1) == 0);
+}
+
+void malloc_lifetimes() {
+    printf("Can separate blocks by lifetime...\n");
+    struct Heap* heap = virtual_heap;
+    program_break = virtual_heap;
+
+    init_allocator(virtual_heap, 10, 7);
+    void* storage = virtual_heap + overhead(heap);
+
+    void* first = virtual_malloc_hint(virtual_heap, 128, LIFETIME_SHORT);
+    void* cache = virtual_malloc_hint(virtual_heap, 128, LIFETIME_LONG);
+    void* second = virtual_malloc_hint(virtual_heap, 256, LIFETIME_SHORT);
+    assert(first == storage + 896);
+    assert(cache == storage);
+    assert(second == storage + 512);
+    assert(virtual_malloc_hint(virtual_heap, 128, 3) == NULL);
+
+    // the short lived blocks merge back once freed
+    virtual_free(virtual_heap, first);
+    virtual_free(virtual_heap, second);
+    assert(assert_virtual_info(
+        "allocated 128\n"
+        "free 128\n"
+        "free 256\n"
+        "free 512\n"
+    ));
+}
+
 
 // TEST VIRTUAL FREE
 
@@ -376,78 +671,397 @@ void free_prune_tree() {
     assert(assert_virtual_info("free 524288\n"));
 }
 
+void free_compact() {
+    printf("Can compact movable blocks...\n");
+    struct Heap* heap = virtual_heap;
+    program_break = virtual_heap;
 
-// TEST VIRTUAL REALLOC
+    init_allocator(virtual_heap, 10, 7);
+    void* storage = virtual_heap + overhead(heap);
+
+    int32_t first = virtual_halloc(virtual_heap, 128);
+    int32_t moving = virtual_halloc(virtual_heap, 128);
+    int32_t middle = virtual_halloc(virtual_heap, 256);
+    int32_t pinned = virtual_halloc(virtual_heap, 512);
 
-void realloc_tree_versions() {
-    printf("Version control...\n");
+    strcpy(virtual_hpin(virtual_heap, moving), "moving");
+    assert(virtual_hunpin(virtual_heap, moving) == 0);
+    assert(virtual_hpin(virtual_heap, pinned) == storage + 512);
+
+    assert(virtual_hfree(virtual_heap, first) == 0);
+    assert(virtual_hfree(virtual_heap, middle) == 0);
+    assert(virtual_hfree(virtual_heap, middle) != 0);
+
+    assert(virtual_compact(virtual_heap, 1) == 1);
+    assert(assert_virtual_info(
+        "allocated 128\n"
+        "free 128\n"
+        "free 256\n"
+        "allocated 512\n"
+    ));
+
+    char* moved = virtual_hpin(virtual_heap, moving);
+    assert(moved == storage && strcmp(moved, "moving") == 0);
+    assert(virtual_compact(virtual_heap, 4) == 0);
+}
+
+void free_deferred() {
+    printf("Can defer coalescing...\n");
     struct Heap* heap = virtual_heap;
     program_break = virtual_heap;
 
-    // CREATE INITIAL TREE
+    init_allocator(virtual_heap, 10, 7);
+    void* storage = virtual_heap + overhead(heap);
+    assert(virtual_config(virtual_heap, OPT_DEFER, 1) == 0);
 
-    init_allocator(virtual_heap, 19, 10);
-    virtual_malloc(virtual_heap, 32000);
+    // freed blocks stay split and are reused directly
+    void* block = virtual_malloc(virtual_heap, 128);
+    assert(virtual_free(virtual_heap, block) == 0);
+    assert(assert_virtual_info(
+        "free 128\n"
+        "free 128\n"
+        "free 256\n"
+        "free 512\n"
+    ));
+    assert(virtual_malloc(virtual_heap, 128) == block);
+    assert(virtual_free(virtual_heap, block) == 0);
+
+    // a failing request merges the deferred blocks
+    assert(virtual_malloc(virtual_heap, 1024) == storage);
+    assert(assert_virtual_info("allocated 1024\n"));
+    assert(virtual_free(virtual_heap, storage) == 0);
+
+    virtual_malloc(virtual_heap, 128);
+    assert(virtual_config(virtual_heap, OPT_DEFER, 0) == 0);
+    assert(virtual_free(virtual_heap, storage) == 0);
+    assert(assert_virtual_info("free 1024\n"));
+}
+
+void free_sized() {
+    printf("Can free with a known size...\n");
+    struct Heap* heap = virtual_heap;
+    program_break = virtual_heap;
+
+    init_allocator(virtual_heap, 10, 7);
+    void* storage = virtual_heap + overhead(heap);
+
+    void* small = virtual_malloc(virtual_heap, 100);
+    void* large = virtual_malloc(virtual_heap, 300);
+
+    assert(virtual_usable_size(virtual_heap, small) == 128);
+    assert(virtual_usable_size(virtual_heap, large) == 512);
+    assert(virtual_usable_size(virtual_heap, small + 1) == 0);
+    assert(virtual_usable_size(virtual_heap, storage + 128) == 0);
+    assert(virtual_usable_size(virtual_heap, NULL) == 0);
+    assert(virtual_usable_size(virtual_heap, storage + 1024) == 0);
+    assert(virtual_usable_size(virtual_heap, storage - 1) == 0);
+
+    // a wrong size falls back to searching for the block
+    assert(virtual_free_sized(virtual_heap, small + 1, 100) != 0);
+    assert(virtual_free_sized(virtual_heap, small, 100) == 0);
+    assert(virtual_free_sized(virtual_heap, large, 100) == 0);
+    assert(assert_virtual_info("free 1024\n"));
+}
+
+void free_maintain() {
+    printf("Can coalesce in the background...\n");
+    program_break = virtual_heap;
+
+    init_allocator(virtual_heap, 10, 7);
+    assert(virtual_worker(virtual_heap, 60000, 8) == 0);
+    assert(virtual_worker(virtual_heap, 60000, 8) != 0);
 
-    assert(assert_version_tree(
-        "└─ 3 -> 0"              "\n"
-        "   ├─ 3 -> 0"           "\n"
-        "   |  ├─ 3 -> 0"        "\n"
-        "   |  |  ├─ 3 -> 0"     "\n"
-        "   |  |  |  ├─ 2 -> 0"  "\n"
-        "   |  |  |  └─ 1 -> 0"  "\n"
-        "   |  |  └─ 1 -> 0"     "\n"
-        "   |  └─ 1 -> 0"        "\n"
-        "   └─ 1 -> 0"           "\n"
+    // freed blocks wait for the worker to be merged
+    void* block = virtual_malloc(virtual_heap, 128);
+    assert(virtual_free(virtual_heap, block) == 0);
+    assert(assert_virtual_info(
+        "free 128\n"
+        "free 128\n"
+        "free 256\n"
+        "free 512\n"
     ));
 
-    // CREATE BACKUP
+    // blocks are merged one level of the tree at a time
+    assert(virtual_maintain(virtual_heap, 1) == 1);
+    assert(assert_virtual_info(
+        "free 256\n"
+        "free 256\n"
+        "free 512\n"
+    ));
+    assert(virtual_maintain(virtual_heap, 8) == 2);
+    assert(assert_virtual_info("free 1024\n"));
+    assert(virtual_maintain(virtual_heap, 8) == 0);
+
+    virtual_malloc(virtual_heap, 128);
+    assert(virtual_free(virtual_heap, block) == 0);
+    assert(virtual_worker(virtual_heap, 0, 0) == 0);
+    assert(assert_virtual_info("free 1024\n"));
+}
+
+void* free_from_thread(void* ptr) {
+    virtual_free_remote(virtual_heap, ptr);
+    return NULL;
+}
+
+void free_purge() {
+    printf("Can return free pages to the system...\n");
+    void* private_heap = virtual_heap;
+    void* mapping = mmap(NULL, 1 << 18, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    // place the heap so that its storage starts on a page
+    struct Heap layout = { .min_size = 12, .cur_size = 16 };
+    virtual_heap = mapping + 4096 - overhead(&layout);
+    program_break = virtual_heap;
+
+    init_allocator(virtual_heap, 16, 12);
+    assert(virtual_config(virtual_heap, OPT_PURGE, 1) == 0);
+    char* block = virtual_malloc(virtual_heap, 16384);
+    memset(block, 0x55, 16384);
+    assert(virtual_free(virtual_heap, block) == 0);
 
-    backup_tree(heap, &heap->root);
+    // one unit visits the merged heap and purges it
+    assert(virtual_maintain(virtual_heap, 8) == 1);
+    assert(block[0] == 0);
 
-    assert(assert_version_tree(
-        "└─ 3 -> 3"              "\n"
-        "   ├─ 3 -> 3"           "\n"
-        "   |  ├─ 3 -> 3"        "\n"
-        "   |  |  ├─ 3 -> 3"     "\n"
-        "   |  |  |  ├─ 2 -> 2"  "\n"
-        "   |  |  |  └─ 1 -> 1"  "\n"
-        "   |  |  └─ 1 -> 1"     "\n"
-        "   |  └─ 1 -> 1"        "\n"
-        "   └─ 1 -> 1"           "\n"
+    // purged blocks are known to be zero, so are not cleared again
+    block[1] = 0x77;
+    block = virtual_calloc(virtual_heap, 1, 16384);
+    assert(block[1] == 0x77);
+
+    // the walk resumes after the allocation and stops at the end
+    assert(virtual_maintain(virtual_heap, 1) == 1);
+    assert(virtual_maintain(virtual_heap, 8) == 2);
+
+    munmap(mapping, 1 << 18);
+    virtual_heap = private_heap;
+}
+
+void free_remote() {
+    printf("Can free from another thread...\n");
+    struct Heap* heap = virtual_heap;
+    program_break = virtual_heap;
+
+    init_allocator(virtual_heap, 10, 7);
+    void* storage = virtual_heap + overhead(heap);
+
+    void* first = virtual_malloc(virtual_heap, 128);
+    void* second = virtual_malloc(virtual_heap, 128);
+
+    pthread_t threads[2];
+    pthread_create(&threads[0], NULL, free_from_thread, first);
+    pthread_create(&threads[1], NULL, free_from_thread, second);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+    assert(virtual_free_remote(virtual_heap, first + 1) != 0);
+
+    // mapped objects are queued the same way
+    assert(virtual_config(virtual_heap, OPT_LARGE, 4096) == 0);
+    void* large = virtual_malloc(virtual_heap, 4096);
+    pthread_create(&threads[0], NULL, free_from_thread, large);
+    pthread_join(threads[0], NULL);
+    assert(heap->larges == 1);
+
+    // queued blocks are untouched until the next allocation
+    assert(assert_virtual_info(
+        "allocated 128\n"
+        "allocated 128\n"
+        "free 256\n"
+        "free 512\n"
     ));
+    assert(virtual_malloc(virtual_heap, 1024) == storage);
+    assert(assert_virtual_info("allocated 1024\n"));
+    assert(heap->larges == 0);
+}
 
-    // MODIFY TREE
+void free_reset() {
+    printf("Can free every block at once...\n");
+    struct Heap* heap = virtual_heap;
+    program_break = virtual_heap;
+
+    init_allocator(virtual_heap, 10, 7);
+    void* storage = virtual_heap + overhead(heap);
 
-    virtual_free(virtual_heap, virtual_heap + overhead(heap));
+    virtual_malloc(virtual_heap, 128);
+    virtual_malloc(virtual_heap, 256);
+    virtual_malloc(virtual_heap, 128);
+    assert(virtual_halloc(virtual_heap, 128) == 0);
 
-    assert(assert_version_tree(
-        "└─ 1 -> 3"              "\n"
-        "   ├─ 0 -> 3"           "\n"
-        "   |  ├─ 0 -> 3"        "\n"
-        "   |  |  ├─ 0 -> 3"     "\n"
-        "   |  |  |  ├─ 0 -> 2"  "\n"
-        "   |  |  |  └─ 0 -> 1"  "\n"
-        "   |  |  └─ 0 -> 1"     "\n"
-        "   |  └─ 0 -> 1"        "\n"
-        "   └─ 0 -> 1"           "\n"
+    virtual_reset(virtual_heap);
+    assert(assert_virtual_info("free 1024\n"));
+    assert(virtual_hpin(virtual_heap, 0) == NULL);
+    assert(virtual_malloc(virtual_heap, 1024) == storage);
+}
+
+void free_shared() {
+    printf("Can share a heap between processes...\n");
+    void* private_heap = virtual_heap;
+    virtual_heap = mmap(NULL, 1 << 16, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    struct Heap* heap = virtual_heap;
+    program_break = virtual_heap;
+
+    init_allocator(virtual_heap, 10, 7);
+    assert(virtual_config(virtual_heap, OPT_PURGE, 1) == 0);
+    assert(virtual_config(virtual_heap, OPT_SHARED, 1) != 0);
+    assert(virtual_config(virtual_heap, OPT_PURGE, 0) == 0);
+    assert(virtual_config(virtual_heap, OPT_SHARED, 1) == 0);
+    assert(virtual_config(virtual_heap, OPT_LARGE, 512) != 0);
+    assert(virtual_config(virtual_heap, OPT_DEFER, 1) != 0);
+    assert(virtual_config(virtual_heap, OPT_PURGE, 1) != 0);
+    assert(virtual_reserve(virtual_heap, 128, 2) == 0);
+    assert(virtual_halloc(virtual_heap, 128) == -1);
+    assert(virtual_enter(virtual_heap) == -1);
+    assert(virtual_worker(virtual_heap, 10, 4) != 0);
+    assert(virtual_worker(virtual_heap, 0, 0) != 0);
+    assert(heap->locking);
+
+    int channel[2];
+    assert(pipe(channel) == 0);
+
+    if (fork() == 0) {
+        char* message = virtual_malloc(virtual_heap, 100);
+        strcpy(message, "message");
+        int64_t offset = virtual_offset(virtual_heap, message);
+        write(channel[1], &offset, sizeof(offset));
+
+        // die while holding the lock
+        pthread_mutex_lock(&heap->lock);
+        _exit(0);
+    }
+
+    int64_t offset = -1;
+    read(channel[0], &offset, sizeof(offset));
+    wait(NULL);
+    close(channel[0]);
+    close(channel[1]);
+
+    // the heap is recovered by the next process to lock it
+    char* message = virtual_pointer(virtual_heap, offset);
+    assert(strcmp(message, "message") == 0);
+    assert(virtual_free(virtual_heap, message) == 0);
+    assert(assert_virtual_info("free 1024\n"));
+    assert(virtual_pointer(virtual_heap, 1024) == NULL);
+    assert(virtual_offset(virtual_heap, NULL) == -1);
+
+    munmap(virtual_heap, 1 << 16);
+    virtual_heap = private_heap;
+}
+
+void free_epochs() {
+    printf("Can defer frees past readers...\n");
+    program_break = virtual_heap;
+
+    init_allocator(virtual_heap, 10, 7);
+    void* block = virtual_malloc(virtual_heap, 128);
+
+    // a reader from before the free keeps the block alive
+    int32_t reader = virtual_enter(virtual_heap);
+    assert(reader >= 0);
+    assert(virtual_free_deferred(virtual_heap, block) == 0);
+    assert(virtual_free_deferred(virtual_heap, block + 1) != 0);
+    assert(virtual_free_deferred(virtual_heap, block) != 0);
+    assert(virtual_reclaim(virtual_heap) == 0);
+    assert(assert_virtual_info(
+        "allocated 128\n"
+        "free 128\n"
+        "free 256\n"
+        "free 512\n"
     ));
 
-    // RESTORE TREE BACKUP
+    virtual_exit(virtual_heap, reader);
+    assert(virtual_reclaim(virtual_heap) == 1);
+    assert(assert_virtual_info("free 1024\n"));
+
+    // a reader from after the free cannot reach the block
+    block = virtual_malloc(virtual_heap, 128);
+    assert(virtual_free_deferred(virtual_heap, block) == 0);
+    reader = virtual_enter(virtual_heap);
+    assert(virtual_reclaim(virtual_heap) == 1);
+    virtual_exit(virtual_heap, reader);
+    assert(assert_virtual_info("free 1024\n"));
+}
+
+
+// TEST VIRTUAL REALLOC
+
+void realloc_large() {
+    printf("Can map large requests...\n");
+    program_break = virtual_heap;
+
+    init_allocator(virtual_heap, 10, 7);
+    assert(virtual_config(virtual_heap, OPT_LARGE, 512) == 0);
+
+    // large requests leave the tree untouched
+    char* large = virtual_malloc(virtual_heap, 600);
+    assert(large != NULL);
+    assert(assert_virtual_info("free 1024\n"));
+    assert(virtual_usable_size(virtual_heap, large) % 4096 == 0);
+    large[599] = 1;
+
+    // growing a block past the threshold moves it into a mapping
+    char* small = virtual_malloc(virtual_heap, 100);
+    small[0] = 2;
+    small = virtual_realloc(virtual_heap, small, 5000);
+    assert(small != NULL && small[0] == 2);
+    assert(assert_virtual_info("free 1024\n"));
+
+    // a null pointer is not taken for an unused slot of the table
+    assert(virtual_realloc(virtual_heap, NULL, 100) == NULL);
+    assert(virtual_usable_size(virtual_heap, NULL) == 0);
+
+    large = virtual_realloc(virtual_heap, large, 100000);
+    assert(large != NULL && large[599] == 1);
+    large[99999] = 1;
+
+    assert(virtual_free(virtual_heap, large) == 0);
+    assert(virtual_free(virtual_heap, small) == 0);
+    assert(virtual_free(virtual_heap, small) != 0);
+}
+
+
+void realloc_failure() {
+    printf("Can restore failed request...\n");
+    struct Heap* heap = virtual_heap;
+    program_break = virtual_heap;
 
-    restore_tree(heap, &heap->root);
+    init_allocator(virtual_heap, 19, 10);
+    char* storage = virtual_heap + overhead(heap);
+
+    char* expected =
+        "└─ 3"              "\n"
+        "   ├─ 3"           "\n"
+        "   |  ├─ 3"        "\n"
+        "   |  |  ├─ 3"     "\n"
+        "   |  |  |  ├─ 2"  "\n"
+        "   |  |  |  └─ 1"  "\n"
+        "   |  |  └─ 1"     "\n"
+        "   |  └─ 1"        "\n"
+        "   └─ 1"           "\n";
 
-    assert(assert_version_tree(
-        "└─ 3 -> 0"              "\n"
-        "   ├─ 3 -> 0"           "\n"
-        "   |  ├─ 3 -> 0"        "\n"
-        "   |  |  ├─ 3 -> 0"     "\n"
-        "   |  |  |  ├─ 2 -> 0"  "\n"
-        "   |  |  |  └─ 1 -> 0"  "\n"
-        "   |  |  └─ 1 -> 0"     "\n"
-        "   |  └─ 1 -> 0"        "\n"
-        "   └─ 1 -> 0"           "\n"
+    virtual_malloc(virtual_heap, 32000);
+    strcpy(storage, "kept");
+    assert(assert_status_tree(expected));
+
+    // request which can never fit
+    assert(!virtual_realloc(virtual_heap, storage, (1 << 19) + 1));
+    assert(assert_status_tree(expected));
+    assert(strcmp(storage, "kept") == 0);
+
+    // request which fails only after the block is merged
+    virtual_malloc(virtual_heap, 1 << 18);
+    assert(!virtual_realloc(virtual_heap, storage, 1 << 19));
+    assert(assert_virtual_info(
+        "allocated 32768\n"
+        "free 32768\n"
+        "free 65536\n"
+        "free 131072\n"
+        "allocated 262144\n"
     ));
+    assert(strcmp(storage, "kept") == 0);
+
+    // only allocations can be reallocated
+    assert(!virtual_realloc(virtual_heap, storage + 32768, 10));
 }
 
 void realloc_simple() {
@@ -457,32 +1071,32 @@ void realloc_simple() {
     init_allocator(virtual_heap, 18, 12);
     void* storage = virtual_heap + overhead(heap);
 
-    assert(assert_version_tree(
-        "└─ 1 -> 0" "\n"
+    assert(assert_status_tree(
+        "└─ 1" "\n"
     ));
 
 
     virtual_malloc(virtual_heap, 1 << 18);
 
-    assert(assert_version_tree(
-        "└─ 2 -> 0" "\n"
+    assert(assert_status_tree(
+        "└─ 2" "\n"
     ));
 
 
     virtual_realloc(virtual_heap, storage, 8123);
 
-    assert(assert_version_tree(
-        "└─ 3 -> 2"                "\n"
-        "   ├─ 3 -> 0"             "\n"
-        "   |  ├─ 3 -> 0"          "\n"
-        "   |  |  ├─ 3 -> 0"       "\n"
-        "   |  |  |  ├─ 3 -> 0"    "\n"
-        "   |  |  |  |  ├─ 2 -> 0" "\n"
-        "   |  |  |  |  └─ 1 -> 0" "\n"
-        "   |  |  |  └─ 1 -> 0"    "\n"
-        "   |  |  └─ 1 -> 0"       "\n"
-        "   |  └─ 1 -> 0"          "\n"
-        "   └─ 1 -> 0"             "\n"
+    assert(assert_status_tree(
+        "└─ 3"                "\n"
+        "   ├─ 3"             "\n"
+        "   |  ├─ 3"          "\n"
+        "   |  |  ├─ 3"       "\n"
+        "   |  |  |  ├─ 3"    "\n"
+        "   |  |  |  |  ├─ 2" "\n"
+        "   |  |  |  |  └─ 1" "\n"
+        "   |  |  |  └─ 1"    "\n"
+        "   |  |  └─ 1"       "\n"
+        "   |  └─ 1"          "\n"
+        "   └─ 1"             "\n"
     ));
 }
 
@@ -528,7 +1142,16 @@ int main(int argc, char** argv) {
         malloc_assigning,
         malloc_lower_bound,
         malloc_invalid_requests,
-        malloc_complex
+        malloc_complex,
+        malloc_policies,
+        malloc_near,
+        malloc_calloc,
+        malloc_subheap,
+        malloc_sampling,
+        malloc_trimming,
+        malloc_any_size,
+        malloc_reserve,
+        malloc_lifetimes
     };
 
     int len = sizeof(malloc_tests)/sizeof(malloc_tests[0]);
@@ -539,7 +1162,16 @@ int main(int argc, char** argv) {
     void (*free_tests[])() = {
         free_simple,
         free_invalid_address,
-        free_prune_tree
+        free_prune_tree,
+        free_compact,
+        free_deferred,
+        free_sized,
+        free_maintain,
+        free_purge,
+        free_remote,
+        free_reset,
+        free_shared,
+        free_epochs
     };
 
     len = sizeof(free_tests)/sizeof(free_tests[0]);
@@ -548,8 +1180,9 @@ int main(int argc, char** argv) {
     // REALLOC TESTS
 
     void (*realloc_tests[])() = {
-        realloc_tree_versions,
-        realloc_simple
+        realloc_failure,
+        realloc_simple,
+        realloc_large
     };
 
     len = sizeof(realloc_tests)/sizeof(realloc_tests[0]);
@@ -1,3 +1,14 @@
+// for mremap
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
 #include "virtual_sbrk.h"
 #include "structure.h"
 #include "virtual_alloc.h"
@@ -13,13 +24,998 @@ uint16_t logorithm(size_t n) {
     }
 
     // round up number
-    return count + (n > (1 << count) ? 1 : 0);
+    return count + (n > ((size_t) 1 << count) ? 1 : 0);
+}
+
+void* map_table(uint64_t bytes) {
+    void* table = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (table == MAP_FAILED) ? NULL : table;
+}
+
+uint64_t fit_node(struct Heap* heap, uint64_t scope, uint8_t size) {
+    // the smallest block which fits, placed by the heap's policy
+    for (int i = size; i <= node_size(heap, scope); i++) {
+        uint64_t node = (heap->policy == SPLIT_MIN)
+            ? find_dense(heap, scope, i)
+            : find_node(heap, scope, i);
+
+        if (node)
+            return node;
+    }
+
+    return 0;
+}
+
+uint64_t place_node(struct Heap* heap, uint64_t scope, uint8_t size, uint8_t lifetime) {
+    // blocks with a lifetime go nearest their end of the heap instead
+    uint64_t best = 0;
+    int64_t best_end = 0;
+    for (int i = size; i <= node_size(heap, scope); i++) {
+        uint64_t node = (lifetime == LIFETIME_SHORT)
+            ? find_last(heap, scope, i)
+            : find_node(heap, scope, i);
+        if (!node)
+            continue;
+
+        int64_t start = node_to_address(heap, node);
+        int64_t end = start + ((int64_t) 1 << i);
+        if (!best || (lifetime == LIFETIME_SHORT && end > best_end)
+                || (lifetime == LIFETIME_LONG && start < node_to_address(heap, best))) {
+            best = node;
+            best_end = end;
+        }
+    }
+
+    return best;
+}
+
+uint64_t choose_node(struct Heap* heap, uint64_t scope, uint8_t size, uint8_t lifetime) {
+    // search ever larger subtrees for a block which fits
+    while (scope) {
+        uint64_t node = (lifetime == LIFETIME_ANY)
+            ? fit_node(heap, scope, size)
+            : place_node(heap, scope, size, lifetime);
+
+        if (node)
+            return node;
+
+        scope = node_parent(heap, scope);
+    }
+
+    return 0;
+}
+
+void forget_deferred(struct Heap* heap) {
+    // deferred blocks may be merged, so their lists are dropped
+    for (int i = 0; i < QUICK_ORDERS && heap->quick; i++) {
+        heap->quick[i].count = 0;
+    }
+}
+
+void coalesce(struct Heap* heap) {
+    forget_deferred(heap);
+    prune_tree(heap, ROOT);
+}
+
+void merge_blocks(struct Heap* heap, int64_t offset, uint64_t bytes) {
+    if (heap->running) {
+        // leave merging to the maintenance worker, from the deepest level
+        heap->dirty = 1;
+        heap->sweep = heap->deepest;
+        return;
+    }
+
+    // only the freed nodes and those above them can have become mergeable
+    int64_t end = offset + bytes;
+    while (offset < end) {
+        uint64_t node = merge_node(heap, locate_node(heap, offset));
+        offset = node_to_address(heap, node) + ((int64_t) 1 << node_size(heap, node));
+    }
+}
+
+int defer_node(struct Heap* heap, uint64_t node) {
+    uint8_t size = node_size(heap, node);
+    if (size >= QUICK_ORDERS || heap->quick[size].count == QUICK_DEPTH)
+        return 0;
+
+    struct Quick* quick = &heap->quick[size];
+    quick->nodes[quick->count++] = node;
+    return 1;
+}
+
+uint64_t reuse_node(struct Heap* heap, uint8_t size) {
+    if (size >= QUICK_ORDERS)
+        return 0;
+
+    struct Quick* quick = &heap->quick[size];
+
+    // entries may have since been merged or allocated elsewhere
+    while (quick->count > 0) {
+        uint64_t node = quick->nodes[--quick->count];
+        if (status(heap, node) == FREE && node_size(heap, node) == size)
+            return node;
+    }
+
+    return 0;
+}
+
+struct Sample* find_sample(struct Heap* heap, int64_t offset) {
+    for (int i = 0; i < SAMPLES; i++) {
+        struct Sample* sample = &heap->samples[i];
+        if (sample->bytes && sample->offset == offset)
+            return sample;
+    }
+
+    return NULL;
+}
+
+void sample_block(struct Heap* heap, int64_t offset, uint32_t bytes) {
+    // count down the bytes until the next sample is due
+    heap->sample_next -= bytes;
+    if (heap->sample_next > 0)
+        return;
+    heap->sample_next = heap->sample_rate;
+
+    if (heap->samples == NULL)
+        heap->samples = map_table(SAMPLES * sizeof(struct Sample));
+    if (heap->samples == NULL)
+        return;
+
+    // the sample is dropped if the table is full
+    struct Sample* sample = NULL;
+    for (int i = 0; i < SAMPLES && sample == NULL; i++) {
+        if (heap->samples[i].bytes == 0)
+            sample = &heap->samples[i];
+    }
+    if (sample == NULL)
+        return;
+
+    sample->offset = offset;
+    sample->bytes = bytes;
+    sample->depth = backtrace(sample->frames, SAMPLE_DEPTH);
+}
+
+void untrack_block(struct Heap* heap, int64_t offset) {
+    if (heap->samples == NULL)
+        return;
+
+    struct Sample* sample = find_sample(heap, offset);
+    if (sample)
+        sample->bytes = 0;
+}
+
+uint64_t round_pages(uint64_t size) {
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    return (size + page - 1) & ~(page - 1);
+}
+
+struct Large* find_large(struct Heap* heap, void* address) {
+    for (int i = 0; i < LARGE_OBJECTS; i++) {
+        if (heap->large[i].address == address)
+            return &heap->large[i];
+    }
+
+    return NULL;
+}
+
+void* map_large(struct Heap* heap, uint64_t size) {
+    struct Large* large = find_large(heap, NULL);
+    if (large == NULL)
+        return NULL;
+
+    uint64_t length = round_pages(size);
+    void* address = mmap(NULL, length, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (address == MAP_FAILED)
+        return NULL;
+
+    large->address = address;
+    large->length = length;
+    heap->larges++;
+
+    // mappings are sampled by their offset, which lies outside the tree
+    if (heap->sample_rate)
+        sample_block(heap, address - heap_storage(heap), size);
+    return address;
+}
+
+void unmap_large(struct Heap* heap, struct Large* large) {
+    untrack_block(heap, large->address - heap_storage(heap));
+    munmap(large->address, large->length);
+    large->address = NULL;
+    large->length = 0;
+    heap->larges--;
+
+    // the table outlives the threshold until its last object is gone
+    if (heap->larges == 0 && heap->large_min == 0) {
+        munmap(heap->large, LARGE_OBJECTS * sizeof(struct Large));
+        heap->large = NULL;
+    }
+}
+
+void unmap_all(struct Heap* heap) {
+    struct Large* table = heap->large;
+    for (int i = 0; i < LARGE_OBJECTS && heap->larges; i++) {
+        if (table[i].address)
+            unmap_large(heap, &table[i]);
+    }
+}
+
+void unmap_tables(struct Heap* heap) {
+    if (heap->quick)
+        munmap(heap->quick, QUICK_ORDERS * sizeof(struct Quick));
+    if (heap->large)
+        munmap(heap->large, LARGE_OBJECTS * sizeof(struct Large));
+    if (heap->reserve)
+        munmap(heap->reserve, sizeof(struct Reserve));
+    if (heap->epochs)
+        munmap(heap->epochs, sizeof(struct Epochs));
+    if (heap->handles)
+        munmap(heap->handles, HANDLES * sizeof(struct Handle));
+    heap->quick = NULL;
+    heap->large = NULL;
+    heap->reserve = NULL;
+    heap->epochs = NULL;
+    heap->handles = NULL;
+}
+
+uint64_t block_bytes(struct Heap* heap, uint64_t node) {
+    int64_t offset = node_to_address(heap, node);
+    uint64_t bytes = (uint64_t) 1 << node_size(heap, node);
+
+    if (heap->tails == 0)
+        return bytes;
+
+    // a trimmed block continues in the tail pieces which follow it
+    uint64_t piece = locate_node(heap, offset + bytes);
+    while (tail(heap, piece)) {
+        bytes += (uint64_t) 1 << node_size(heap, piece);
+        piece = locate_node(heap, offset + bytes);
+    }
+
+    return bytes;
+}
+
+uint64_t free_pieces(struct Heap* heap, uint64_t node) {
+    int64_t start = node_to_address(heap, node);
+    int64_t offset = start + ((int64_t) 1 << node_size(heap, node));
+
+    untrack_block(heap, start);
+    set_status(heap, node, FREE);
+
+    if (heap->tails == 0)
+        return offset - start;
+
+    uint64_t piece = locate_node(heap, offset);
+    while (tail(heap, piece)) {
+        offset += (int64_t) 1 << node_size(heap, piece);
+        set_tail(heap, piece, 0);
+        set_status(heap, piece, FREE);
+        heap->tails--;
+        piece = locate_node(heap, offset);
+    }
+
+    return offset - start;
+}
+
+void release_node(struct Heap* heap, uint64_t node) {
+    uint64_t bytes = free_pieces(heap, node);
+
+    if (heap->deferred && defer_node(heap, node))
+        return;
+
+    merge_blocks(heap, node_to_address(heap, node), bytes);
 }
 
-void allocation_status(struct Heap* heap, uint8_t* node) {
-    if (is_valid(heap, node)) {
-        if (status(node) == ALLOC || status(node) == FREE) {
-            char* status_str = (status(node) == ALLOC) ? "allocated" : "free";
+void drain_remote(struct Heap* heap) {
+    if (__atomic_load_n(&heap->remote, __ATOMIC_RELAXED) == 0)
+        return;
+
+    // take the whole queue at once, so it never has to be unlinked
+    uint64_t link = __atomic_exchange_n(&heap->remote, 0, __ATOMIC_ACQUIRE);
+    void* storage = heap_storage(heap);
+
+    while (link) {
+        int64_t byte_offset = link - 1;
+        link = *(uint64_t*) (storage + byte_offset);
+
+        // mapped objects are only known to be so once the table is read
+        struct Large* large = (heap->larges) ? find_large(heap, storage + byte_offset) : NULL;
+        uint64_t node = address_to_node(heap, byte_offset);
+        if (large) {
+            unmap_large(heap, large);
+        } else if (status(heap, node) == ALLOC && !tail(heap, node)) {
+            merge_blocks(heap, byte_offset, free_pieces(heap, node));
+        }
+    }
+}
+
+void* allocate(void* heapstart, uint32_t size, uint64_t scope, int zero, uint8_t lifetime) {
+    struct Heap* heap = heapstart;
+    uint32_t requested = size;
+
+    drain_remote(heap);
+
+    if (size < (1 << heap->min_size)) {
+        size = 1 << heap->min_size;
+    } else if (size > ((uint64_t) 1 << heap->cur_size)) {
+        return NULL;
+    }
+
+    // log base two of the size, which rounds up
+    uint8_t log_size = logorithm(size);
+
+    // cached blocks lie anywhere, so are not given to a placed request
+    uint64_t node = 0;
+    int placed = scope != ROOT || lifetime != LIFETIME_ANY;
+    struct Reserve* reserve = heap->reserve;
+    if (reserve && reserve->count && reserve->size == log_size && !placed) {
+        // reserved blocks are already split and allocated
+        node = reserve->nodes[--reserve->count];
+    } else if (heap->deferred && !placed) {
+        node = reuse_node(heap, log_size);
+    }
+
+    if (!node) {
+        node = choose_node(heap, scope, log_size, lifetime);
+    }
+
+    if (!node && (heap->deferred || heap->dirty)) {
+        // merge the deferred blocks and try again
+        coalesce(heap);
+        heap->dirty = 0;
+        node = choose_node(heap, scope, log_size, lifetime);
+    }
+
+    if (node) {
+        // split the chosen block down to the required size, towards the
+        // end of the heap the block's lifetime belongs to
+        node = (lifetime == LIFETIME_SHORT)
+            ? split_last(heap, node, log_size)
+            : split_node(heap, node, log_size);
+        uint8_t clean = zeroed(heap, node);
+
+        if (heap->trim) {
+            node = trim_node(heap, node, requested);
+        } else {
+            set_status(heap, node, ALLOC);
+        }
+
+        // convert node to pointer to the storage
+        void* address = heap_storage(heap);
+        address += node_to_address(heap, node);
+
+        // only clear the requested bytes of a block which may be dirty
+        if (zero && !clean)
+            memset(address, 0, requested);
+        set_zeroed(heap, node, 0);
+
+        if (heap->sample_rate)
+            sample_block(heap, node_to_address(heap, node), requested);
+
+        return address;
+    } else {
+        return NULL;
+    }
+}
+
+void* allocate_object(void* heapstart, uint32_t size, uint64_t scope, int zero, uint8_t lifetime) {
+    struct Heap* heap = heapstart;
+
+    // mappings are fresh from the kernel, so are already zeroed
+    if (heap->large_min && size >= heap->large_min) {
+        void* address = map_large(heap, size);
+        if (address)
+            return address;
+    }
+
+    return allocate(heapstart, size, scope, zero, lifetime);
+}
+
+void release_reserved(struct Heap* heap) {
+    struct Reserve* reserve = heap->reserve;
+    if (reserve == NULL || reserve->count == 0)
+        return;
+
+    while (reserve->count > 0) {
+        uint64_t node = reserve->nodes[--reserve->count];
+        set_status(heap, node, FREE);
+        merge_blocks(heap, node_to_address(heap, node), (uint64_t) 1 << reserve->size);
+    }
+}
+
+uint32_t reserve_blocks(void* heapstart, uint32_t size, uint32_t count) {
+    struct Heap* heap = heapstart;
+    release_reserved(heap);
+
+    if (count == 0) {
+        return 0;
+    } else if (size < (1 << heap->min_size)) {
+        size = 1 << heap->min_size;
+    } else if (size > ((uint64_t) 1 << heap->cur_size)) {
+        return 0;
+    }
+
+    if (heap->reserve == NULL && !heap->shared)
+        heap->reserve = map_table(sizeof(struct Reserve));
+    if (heap->reserve == NULL)
+        return 0;
+
+    struct Reserve* reserve = heap->reserve;
+    uint8_t log_size = logorithm(size);
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    reserve->size = log_size;
+
+    while (reserve->count < count && reserve->count < RESERVED) {
+        uint64_t node = choose_node(heap, ROOT, log_size, LIFETIME_ANY);
+        if (!node)
+            break;
+
+        node = split_node(heap, node, log_size);
+        set_status(heap, node, ALLOC);
+        set_zeroed(heap, node, 0);
+
+        // fault the pages in now rather than on first use
+        volatile char* address = heap_storage(heap) + node_to_address(heap, node);
+        for (uint64_t i = 0; i < ((uint64_t) 1 << log_size); i += page) {
+            address[i] = address[i];
+        }
+
+        reserve->nodes[reserve->count++] = node;
+    }
+
+    return reserve->count;
+}
+
+struct Handle* handle_of(struct Heap* heap, int32_t handle) {
+    if (!heap->handles || handle < 0 || handle >= HANDLES || !heap->handles[handle].used)
+        return NULL;
+
+    return &heap->handles[handle];
+}
+
+int move_block(void* heapstart, struct Handle* handle) {
+    struct Heap* heap = heapstart;
+    void* storage = heap_storage(heap);
+
+    uint64_t node = locate_node(heap, handle->offset);
+    uint8_t size = node_size(heap, node);
+
+    // a trimmed block spans several nodes, so it stays where it is
+    if (block_bytes(heap, node) != ((uint64_t) 1 << size))
+        return 0;
+
+    // take the smallest free block which lies before the current one
+    for (int i = size; i <= heap->cur_size; i++) {
+        uint64_t target = find_node(heap, ROOT, i);
+        if (!target)
+            continue;
+
+        int64_t offset = node_to_address(heap, target);
+        if (offset >= handle->offset)
+            continue;
+
+        target = split_node(heap, target, size);
+        set_status(heap, target, ALLOC);
+        set_zeroed(heap, target, 0);
+        memmove(storage + offset, storage + handle->offset, 1 << size);
+
+        struct Sample* sample = (heap->samples) ? find_sample(heap, handle->offset) : NULL;
+        if (sample)
+            sample->offset = offset;
+
+        set_status(heap, node, FREE);
+        merge_node(heap, node);
+        handle->offset = offset;
+        return 1;
+    }
+
+    return 0;
+}
+
+struct Epochs* epoch_table(struct Heap* heap) {
+    struct Epochs* epochs = __atomic_load_n(&heap->epochs, __ATOMIC_ACQUIRE);
+    if (epochs || heap->shared)
+        return epochs;
+
+    // readers enter without the lock, so the first table installed wins
+    struct Epochs* table = map_table(sizeof(struct Epochs));
+    if (table == NULL)
+        return NULL;
+    if (!__atomic_compare_exchange_n(&heap->epochs, &epochs, table,
+            0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        munmap(table, sizeof(struct Epochs));
+    return __atomic_load_n(&heap->epochs, __ATOMIC_ACQUIRE);
+}
+
+uint32_t reclaim_retired(void* heapstart) {
+    struct Heap* heap = heapstart;
+
+    struct Epochs* epochs = __atomic_load_n(&heap->epochs, __ATOMIC_ACQUIRE);
+    if (epochs == NULL)
+        return 0;
+
+    // blocks retired before the oldest reader entered are unreachable
+    uint64_t oldest = UINT64_MAX;
+    for (int i = 0; i < READERS; i++) {
+        uint64_t epoch = __atomic_load_n(&epochs->readers[i], __ATOMIC_ACQUIRE);
+        if (epoch && epoch < oldest)
+            oldest = epoch;
+    }
+
+    uint32_t kept = 0;
+    uint32_t released = 0;
+    for (uint32_t i = 0; i < heap->retired; i++) {
+        struct Retired* retired = &epochs->retire[i];
+        if (retired->epoch >= oldest) {
+            epochs->retire[kept++] = *retired;
+            continue;
+        }
+
+        void* ptr = heap_storage(heap) + retired->offset;
+        struct Large* large = (heap->larges) ? find_large(heap, ptr) : NULL;
+        uint64_t node = address_to_node(heap, retired->offset);
+        if (large) {
+            unmap_large(heap, large);
+        } else if (status(heap, node) == ALLOC && !tail(heap, node)) {
+            merge_blocks(heap, retired->offset, free_pieces(heap, node));
+        }
+        released++;
+    }
+    heap->retired = kept;
+
+    return released;
+}
+
+int retire_block(void* heapstart, void* ptr) {
+    struct Heap* heap = heapstart;
+    int64_t byte_offset = ptr - heap_storage(heap);
+    uint64_t node = address_to_node(heap, byte_offset);
+
+    int allocated = status(heap, node) == ALLOC && !tail(heap, node);
+    if (!ptr || !(allocated || (heap->larges && find_large(heap, ptr))))
+        return 1;
+
+    struct Epochs* epochs = epoch_table(heap);
+    if (epochs == NULL)
+        return 1;
+
+    for (uint32_t i = 0; i < heap->retired; i++) {
+        if (epochs->retire[i].offset == byte_offset)
+            return 1;
+    }
+
+    if (heap->retired == RETIRED && reclaim_retired(heapstart) == 0)
+        return 1;
+
+    // readers entering from now on can no longer reach the block
+    struct Retired* retired = &epochs->retire[heap->retired++];
+    retired->offset = byte_offset;
+    retired->epoch = __atomic_fetch_add(&heap->epoch, 1, __ATOMIC_ACQ_REL);
+
+    if (heap->retired >= RETIRE_BATCH)
+        reclaim_retired(heapstart);
+
+    return 0;
+}
+
+void recover_heap(struct Heap* heap) {
+    repair_tree(heap);
+    release_reserved(heap);
+
+    // cached nodes may have been left half updated, so rebuild them
+    heap->dirty = 0;
+    coalesce(heap);
+}
+
+void lock_heap(struct Heap* heap) {
+    if (!heap->locking)
+        return;
+
+    if (pthread_mutex_lock(&heap->lock) == EOWNERDEAD) {
+        // another process died while holding the lock of a shared heap
+        recover_heap(heap);
+        pthread_mutex_consistent(&heap->lock);
+    }
+}
+
+void unlock_heap(struct Heap* heap) {
+    if (heap->locking)
+        pthread_mutex_unlock(&heap->lock);
+}
+
+int free_block(void* heapstart, void* ptr) {
+    // the storage of a sub heap may lie before its data structure
+    if (!ptr)
+        return 1;
+
+    struct Heap* heap = heapstart;
+    struct Large* large = (heap->larges) ? find_large(heap, ptr) : NULL;
+    if (large) {
+        unmap_large(heap, large);
+        return 0;
+    }
+
+    int64_t byte_offset = ptr - heap_storage(heap);
+
+    uint64_t node = address_to_node(heap, byte_offset);
+
+    if (is_valid(heap, node) && !tail(heap, node)) {
+        release_node(heap, node);
+        return 0;
+    } else {
+        return 1;
+    }
+}
+
+void* resize_block(void* heapstart, void* ptr, uint32_t size) {
+    struct Heap* heap = heapstart;
+    // unused slots of the table hold NULL, so it must not be looked up
+    struct Large* large = (heap->larges && ptr) ? find_large(heap, ptr) : NULL;
+
+    if (large) {
+        // the kernel moves the pages, so nothing is copied
+        uint64_t length = round_pages((size) ? size : 1);
+        void* address = mremap(large->address, large->length, length, MREMAP_MAYMOVE);
+        if (address == MAP_FAILED)
+            return NULL;
+
+        // a sample follows its mapping wherever it moves
+        struct Sample* sample = (heap->samples)
+            ? find_sample(heap, large->address - heap_storage(heap)) : NULL;
+        if (sample) {
+            sample->offset = address - heap_storage(heap);
+            sample->bytes = (size) ? size : 1;
+        }
+
+        large->address = address;
+        large->length = length;
+        return address;
+    }
+
+    int64_t byte_offset = ptr - heap_storage(heap);
+    uint64_t node = address_to_node(heap, byte_offset);
+
+    // a tail piece is resized only along with its block
+    if (status(heap, node) != ALLOC || tail(heap, node))
+        return NULL;
+
+    uint8_t old_size = node_size(heap, node);
+    uint64_t old_bytes = block_bytes(heap, node);
+
+    if (old_bytes != ((uint64_t) 1 << old_size)) {
+        // the pieces of a trimmed block cannot be claimed back on failure
+        void* address = allocate_object(heapstart, size, ROOT, 0, LIFETIME_ANY);
+        if (address) {
+            memcpy(address, ptr, (old_bytes < size) ? old_bytes : size);
+            release_node(heap, node);
+        }
+        return address;
+    }
+
+    if (heap->large_min && size >= heap->large_min) {
+        // a block growing past the threshold moves to its own mapping
+        void* address = map_large(heap, size);
+        if (address) {
+            memcpy(address, ptr, (old_bytes < size) ? old_bytes : size);
+            release_node(heap, node);
+            return address;
+        }
+    }
+
+    release_node(heap, node);
+
+    void* address = allocate(heapstart, size, ROOT, 0, LIFETIME_ANY);
+
+    if (address == NULL) {
+        // the block was just freed, so its memory can be taken back
+        claim_node(heap, byte_offset, old_size);
+        return NULL;
+    }
+
+    // move the data
+    uint64_t min = (old_bytes < size) ? old_bytes : size;
+    memmove(address, ptr, min);
+    return address;
+}
+
+uint32_t compact_blocks(void* heapstart, uint32_t budget) {
+    struct Heap* heap = heapstart;
+    uint64_t stuck = 0;
+    uint32_t moved = 0;
+
+    while (moved < budget && heap->handles) {
+        // move the highest unpinned block, which frees the most space
+        int32_t highest = -1;
+        for (int32_t i = 0; i < HANDLES; i++) {
+            struct Handle* handle = &heap->handles[i];
+            if (!handle->used || handle->pins || (stuck >> i) & 1)
+                continue;
+            if (highest < 0 || handle->offset > heap->handles[highest].offset)
+                highest = i;
+        }
+
+        if (highest < 0) {
+            break;
+        } else if (move_block(heapstart, &heap->handles[highest])) {
+            moved++;
+        } else {
+            stuck |= (uint64_t) 1 << highest;
+        }
+    }
+
+    return moved;
+}
+
+uint32_t purge_tree(void* heapstart, uint32_t budget) {
+    struct Heap* heap = heapstart;
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint32_t done = 0;
+
+    // each block visited costs a unit, purged or not, and the walk resumes
+    // where the last one stopped until it reaches the end of the heap
+    while (done < budget && heap->purged < heap->limit) {
+        uint64_t node = locate_node(heap, heap->purged);
+        uint64_t size = (uint64_t) 1 << node_size(heap, node);
+        void* address = heap_storage(heap) + node_to_address(heap, node);
+        heap->purged = node_to_address(heap, node) + size;
+        done++;
+
+        // only whole pages can be returned, which then read back as zero
+        if (status(heap, node) != FREE || zeroed(heap, node) || size < page
+                || (uintptr_t) address % page)
+            continue;
+
+        if (madvise(address, size, MADV_DONTNEED) == 0)
+            set_zeroed(heap, node, 1);
+    }
+
+    if (heap->purged >= heap->limit)
+        heap->purged = 0;
+
+    return done;
+}
+
+uint32_t maintain(void* heapstart, uint32_t budget) {
+    struct Heap* heap = heapstart;
+    uint32_t done = 0;
+
+    // merging is spread over one unit per level, and starts over from
+    // the deepest level if more blocks are freed in between
+    while (heap->dirty && heap->sweep && done < budget) {
+        forget_deferred(heap);
+        merge_level(heap, heap->sweep--);
+        done++;
+    }
+    if (heap->sweep == 0)
+        heap->dirty = 0;
+
+    if (heap->retired && done < budget)
+        done += (reclaim_retired(heapstart) > 0);
+
+    if (heap->purge && done < budget)
+        done += purge_tree(heapstart, budget - done);
+
+    if (done < budget)
+        done += compact_blocks(heapstart, budget - done);
+
+    return done;
+}
+
+void* maintain_loop(void* heapstart) {
+    struct Heap* heap = heapstart;
+
+    // the lock is only given up while waiting for the next period
+    pthread_mutex_lock(&heap->lock);
+    while (heap->running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += heap->period / 1000;
+        deadline.tv_nsec += (heap->period % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        pthread_cond_timedwait(&heap->wake, &heap->lock, &deadline);
+        if (heap->running)
+            maintain(heapstart, heap->budget);
+    }
+    pthread_mutex_unlock(&heap->lock);
+
+    return NULL;
+}
+
+int share_heap(struct Heap* heap) {
+    // pointers into this process' own mappings mean nothing to another
+    if (heap->running || heap->large || heap->samples || heap->sample_rate
+            || heap->quick || heap->reserve || heap->epochs || heap->handles)
+        return 1;
+
+    // shared pages keep their contents when purged, so never read as zero
+    if (heap->purge)
+        return 1;
+
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_destroy(&heap->lock);
+    int result = pthread_mutex_init(&heap->lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+
+    pthread_condattr_t condition;
+    pthread_condattr_init(&condition);
+    pthread_condattr_setpshared(&condition, PTHREAD_PROCESS_SHARED);
+    pthread_cond_destroy(&heap->wake);
+    pthread_cond_init(&heap->wake, &condition);
+    pthread_condattr_destroy(&condition);
+
+    if (result != 0)
+        return 1;
+
+    heap->shared = 1;
+    heap->locking = 1;
+    return 0;
+}
+
+int configure(struct Heap* heap, uint8_t option, uint64_t value) {
+    switch (option) {
+        case OPT_POLICY:
+            if (value != LEFTMOST && value != SPLIT_MIN)
+                return 1;
+            heap->policy = value;
+            return 0;
+        case OPT_ZEROED:
+            if (value)
+                zero_tree(heap, ROOT);
+            return 0;
+        case OPT_DEFER:
+            if (value && !heap->quick && !heap->shared)
+                heap->quick = map_table(QUICK_ORDERS * sizeof(struct Quick));
+            if (value && !heap->quick)
+                return 1;
+            heap->deferred = (value != 0);
+            if (!heap->deferred)
+                coalesce(heap);
+            if (!heap->deferred && heap->quick) {
+                munmap(heap->quick, QUICK_ORDERS * sizeof(struct Quick));
+                heap->quick = NULL;
+            }
+            return 0;
+        case OPT_PURGE:
+            if (heap->shared && value)
+                return 1;
+            heap->purge = (value != 0);
+            return 0;
+        case OPT_TRIM:
+            heap->trim = (value != 0);
+            return 0;
+        case OPT_LARGE:
+            if (value && !heap->large && !heap->shared)
+                heap->large = map_table(LARGE_OBJECTS * sizeof(struct Large));
+            if (value && !heap->large)
+                return 1;
+            heap->large_min = value;
+            if (!value && heap->large && heap->larges == 0) {
+                munmap(heap->large, LARGE_OBJECTS * sizeof(struct Large));
+                heap->large = NULL;
+            }
+            return 0;
+        case OPT_SAMPLE:
+            if (heap->shared && value)
+                return 1;
+            heap->sample_rate = value;
+            heap->sample_next = value;
+            if (!value && heap->samples) {
+                munmap(heap->samples, SAMPLES * sizeof(struct Sample));
+                heap->samples = NULL;
+            }
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+void init_heap(void* heapstart, uint64_t bytes, uint8_t min_size) {
+    struct Heap* heap = heapstart;
+    heap -> cur_size = logorithm(bytes);
+    heap -> min_size = min_size;
+    heap -> limit = bytes;
+    heap -> storage = overhead(heap);
+    heap -> policy = LEFTMOST;
+    heap -> deferred = 0;
+    heap -> purge = 0;
+    heap -> purged = 0;
+    heap -> trim = 0;
+    heap -> shared = 0;
+    heap -> remote = 0;
+    heap -> reserve = NULL;
+    heap -> epoch = 1;
+    heap -> retired = 0;
+    heap -> epochs = NULL;
+    heap -> sample_rate = 0;
+    heap -> sample_next = 0;
+    heap -> samples = NULL;
+    heap -> large_min = 0;
+    heap -> larges = 0;
+    heap -> large = NULL;
+    heap -> quick = NULL;
+    heap -> handles = NULL;
+
+    // locking is only needed once a worker shares the heap
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&heap->lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+    pthread_cond_init(&heap->wake, NULL);
+    heap -> locking = 0;
+    heap -> running = 0;
+    heap -> dirty = 0;
+
+    // initialise all nodes to inactive, then free the root
+    heap -> deepest = heap->cur_size - min_size;
+    clear_tree(heap);
+}
+
+void profile_text(struct Heap* heap, FILE* out) {
+    for (int i = 0; i < SAMPLES; i++) {
+        struct Sample* sample = &heap->samples[i];
+        if (sample->bytes == 0)
+            continue;
+
+        fprintf(out, "%u bytes at offset %ld\n", sample->bytes, sample->offset);
+        for (uint32_t j = 0; j < sample->depth; j++) {
+            fprintf(out, "    %p\n", sample->frames[j]);
+        }
+    }
+}
+
+void profile_pprof(struct Heap* heap, FILE* out) {
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+    for (int i = 0; i < SAMPLES; i++) {
+        count += (heap->samples[i].bytes != 0);
+        bytes += heap->samples[i].bytes;
+    }
+
+    // every sample is reported as live, as freed ones are forgotten
+    fprintf(out, "heap profile: %lu: %lu [%lu: %lu] @ heap_v2/%lu\n",
+        count, bytes, count, bytes, heap->sample_rate);
+    for (int i = 0; i < SAMPLES; i++) {
+        struct Sample* sample = &heap->samples[i];
+        if (sample->bytes == 0)
+            continue;
+
+        fprintf(out, "1: %u [1: %u] @", sample->bytes, sample->bytes);
+        for (uint32_t j = 0; j < sample->depth; j++) {
+            fprintf(out, " %p", sample->frames[j]);
+        }
+        fprintf(out, "\n");
+    }
+
+    // pprof symbolises the addresses using the process' mappings
+    fprintf(out, "\nMAPPED_LIBRARIES:\n");
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if (maps < 0)
+        return;
+
+    char buffer[4096];
+    ssize_t length;
+    while ((length = read(maps, buffer, sizeof(buffer))) > 0) {
+        fwrite(buffer, 1, length, out);
+    }
+    close(maps);
+}
+
+void allocation_status(struct Heap* heap, uint64_t node) {
+    // the memory beyond the limit is not part of the heap
+    if (is_valid(heap, node) && node_to_address(heap, node) < heap->limit) {
+        if (status(heap, node) == ALLOC || status(heap, node) == FREE) {
+            char* status_str = (status(heap, node) == ALLOC) ? "allocated" : "free";
             printf("%s %d\n", status_str, 1 << node_size(heap, node));
         } else {
             allocation_status(heap, node_left(heap, node));
@@ -31,111 +1027,480 @@ void allocation_status(struct Heap* heap, uint8_t* node) {
 // FOWARD FACING FUNCTIONS
 
 void init_allocator(void* heapstart, uint8_t initial_size, uint8_t min_size) {
+    init_allocator_bytes(heapstart, (uint64_t) 1 << initial_size, min_size);
+}
+
+void init_allocator_bytes(void* heapstart, uint64_t bytes, uint8_t min_size) {
+    // only whole blocks of the smallest size can be used
+    uint64_t min_bytes = (uint64_t) 1 << min_size;
+    bytes = (bytes < min_bytes) ? min_bytes : bytes & ~(min_bytes - 1);
+
     // set program break to byte after last address
     virtual_sbrk(1);
 
-    // initialise heap
     struct Heap* heap = heapstart;
-    heap -> cur_size = initial_size;
+    heap -> cur_size = logorithm(bytes);
     heap -> min_size = min_size;
-    heap -> root = 1;
 
     // update program break to contain buddy data structure
     virtual_sbrk(overhead(heap) + 1);
+    init_heap(heapstart, bytes, min_size);
 
-    // initialise all nodes after root to inactive
-    for (int i=3; i < overhead(heap) + 1; i++) {
-        uint8_t* byte = heapstart + i;
-        if (i > 2) {
-            enum status current = INACTIVE;
-            *byte = current;
-        }
+    // update program_break to contain the storage memory, in steps the
+    // break's signed 32 bit increment can hold
+    for (uint64_t moved = 0; moved < bytes; moved += INT32_MAX) {
+        virtual_sbrk((bytes - moved < INT32_MAX) ? bytes - moved : INT32_MAX);
     }
-
-    // update program_break to contain the storage memory
-    virtual_sbrk(1 << initial_size);
 }
 
 void* virtual_malloc(void* heapstart, uint32_t size) {
     struct Heap* heap = heapstart;
-    uint8_t* root = &heap->root;
 
-    if (size < (1 << heap->min_size)) {
-        size = 1 << heap->min_size;
-    } else if (size > (1 << heap->cur_size)) {
+    lock_heap(heap);
+    void* address = allocate_object(heapstart, size, ROOT, 0, LIFETIME_ANY);
+    unlock_heap(heap);
+
+    return address;
+}
+
+void* virtual_calloc(void* heapstart, uint32_t count, uint32_t size) {
+    struct Heap* heap = heapstart;
+    uint64_t bytes = (uint64_t) count * size;
+
+    if (bytes > UINT32_MAX)
         return NULL;
-    }
 
-    // log base two of the size, which rounds up
-    uint8_t log_size = logorithm(size);
+    lock_heap(heap);
+    void* address = allocate_object(heapstart, bytes, ROOT, 1, LIFETIME_ANY);
+    unlock_heap(heap);
 
-    // grow tree to required size
-    grow_tree(heap, log_size);
+    return address;
+}
 
-    uint8_t* node = find_node(heap, root, log_size);
+void* virtual_malloc_hint(void* heapstart, uint32_t size, uint8_t lifetime) {
+    struct Heap* heap = heapstart;
 
-    if (node != NULL) {
-        set_status(node, ALLOC);
+    if (lifetime > LIFETIME_SHORT)
+        return NULL;
 
-        // convert node to pointer to the storage
-        void* address = heapstart + overhead(heap);
-        struct Parcel parcel = { heap, 0, node };
-        address += node_to_address(root, &parcel);
+    lock_heap(heap);
+    void* address = allocate_object(heapstart, size, ROOT, 0, lifetime);
+    unlock_heap(heap);
 
-        return address;
+    return address;
+}
+
+void* virtual_malloc_near(void* heapstart, uint32_t size, void* hint) {
+    struct Heap* heap = heapstart;
+    int64_t byte_offset = hint - heap_storage(heap);
+
+    lock_heap(heap);
+    drain_remote(heap);
+    uint64_t node = locate_node(heap, byte_offset);
+
+    if (status(heap, node) != ALLOC)
+        node = ROOT;
+
+    void* address = allocate_object(heapstart, size, node, 0, LIFETIME_ANY);
+    unlock_heap(heap);
+
+    return address;
+}
+
+int virtual_free(void* heapstart, void* ptr) {
+    struct Heap* heap = heapstart;
+
+    lock_heap(heap);
+    int result = free_block(heapstart, ptr);
+    unlock_heap(heap);
+
+    return result;
+}
+
+int virtual_free_sized(void* heapstart, void* ptr, uint32_t size) {
+    struct Heap* heap = heapstart;
+    int64_t byte_offset = ptr - heap_storage(heap);
+    int result = 0;
+
+    if (size < (1 << heap->min_size))
+        size = 1 << heap->min_size;
+
+    lock_heap(heap);
+    uint64_t node = level_node(heap, byte_offset, logorithm(size));
+
+    if (status(heap, node) == ALLOC && !tail(heap, node)) {
+        release_node(heap, node);
     } else {
-        return NULL;
+        // the size did not match the block, so search for it instead
+        result = free_block(heapstart, ptr);
     }
+    unlock_heap(heap);
+
+    return result;
 }
 
-int virtual_free(void* heapstart, void* ptr) {
-    if (!ptr || ptr - heapstart < 0)
+int virtual_free_remote(void* heapstart, void* ptr) {
+    struct Heap* heap = heapstart;
+    int64_t byte_offset = ptr - heap_storage(heap);
+    int64_t min_bytes = (int64_t) 1 << heap->min_size;
+
+    // the tree cannot be touched from here, so only queueable blocks are
+    // accepted, and the link is stored in the block so must fit in it
+    int mapped = byte_offset < 0 || byte_offset >= heap->limit;
+    if (!ptr || byte_offset == -1 || (!mapped && (min_bytes < sizeof(uint64_t)
+            || byte_offset & (min_bytes - 1))))
         return 1;
 
+    uint64_t head = __atomic_load_n(&heap->remote, __ATOMIC_RELAXED);
+    do {
+        *(uint64_t*) ptr = head;
+    } while (!__atomic_compare_exchange_n(&heap->remote, &head, byte_offset + 1,
+        1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    return 0;
+}
+
+int virtual_free_deferred(void* heapstart, void* ptr) {
     struct Heap* heap = heapstart;
-    int64_t byte_offset = ptr - (heapstart + overhead(heap));
 
-    struct Parcel parcel = { heap, 0, &byte_offset };
-    uint8_t* node = address_to_node(&heap->root, &parcel);
+    lock_heap(heap);
+    int result = retire_block(heapstart, ptr);
+    unlock_heap(heap);
 
-    if (is_valid(heap, node)) {
-        set_status(node, FREE);
-        prune_tree(heap, &heap->root);
+    return result;
+}
+
+int32_t virtual_enter(void* heapstart) {
+    struct Heap* heap = heapstart;
+
+    struct Epochs* epochs = epoch_table(heap);
+    if (epochs == NULL)
+        return -1;
+
+    // a stale epoch only delays reclamation, so it may be read early
+    uint64_t epoch = __atomic_load_n(&heap->epoch, __ATOMIC_ACQUIRE);
+    for (int32_t i = 0; i < READERS; i++) {
+        uint64_t empty = 0;
+        if (__atomic_compare_exchange_n(&epochs->readers[i], &empty, epoch,
+                0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            return i;
+    }
+
+    return -1;
+}
+
+void virtual_exit(void* heapstart, int32_t reader) {
+    struct Heap* heap = heapstart;
+
+    struct Epochs* epochs = __atomic_load_n(&heap->epochs, __ATOMIC_ACQUIRE);
+    if (epochs && reader >= 0 && reader < READERS)
+        __atomic_store_n(&epochs->readers[reader], 0, __ATOMIC_RELEASE);
+}
+
+uint32_t virtual_reclaim(void* heapstart) {
+    struct Heap* heap = heapstart;
+
+    lock_heap(heap);
+    uint32_t released = reclaim_retired(heapstart);
+    unlock_heap(heap);
+
+    return released;
+}
+
+uint64_t virtual_usable_size(void* heapstart, void* ptr) {
+    struct Heap* heap = heapstart;
+    int64_t byte_offset = ptr - heap_storage(heap);
+
+    lock_heap(heap);
+    struct Large* large = (heap->larges && ptr) ? find_large(heap, ptr) : NULL;
+    uint64_t node = (large) ? 0 : locate_node(heap, byte_offset);
+    uint64_t size = 0;
+
+    // only the start of an allocated block has a size
+    if (large) {
+        size = large->length;
+    } else if (node && status(heap, node) == ALLOC && !tail(heap, node)
+            && node_to_address(heap, node) == byte_offset) {
+        size = block_bytes(heap, node);
+    }
+    unlock_heap(heap);
+
+    return size;
+}
+
+void* virtual_realloc(void* heapstart, void* ptr, uint32_t size) {
+    struct Heap* heap = heapstart;
+
+    lock_heap(heap);
+    void* address = resize_block(heapstart, ptr, size);
+    unlock_heap(heap);
+
+    return address;
+}
+
+int32_t virtual_halloc(void* heapstart, uint32_t size) {
+    struct Heap* heap = heapstart;
+    int32_t result = -1;
+
+    lock_heap(heap);
+    if (heap->handles == NULL && !heap->shared)
+        heap->handles = map_table(HANDLES * sizeof(struct Handle));
+
+    for (int32_t i = 0; i < HANDLES && heap->handles && result < 0; i++) {
+        struct Handle* handle = &heap->handles[i];
+        if (handle->used)
+            continue;
+
+        void* address = allocate(heapstart, size, ROOT, 0, LIFETIME_ANY);
+        if (address == NULL)
+            break;
+
+        handle->offset = address - heap_storage(heap);
+        handle->used = 1;
+        handle->pins = 0;
+        result = i;
+    }
+    unlock_heap(heap);
+
+    return result;
+}
+
+void* virtual_hpin(void* heapstart, int32_t handle) {
+    struct Heap* heap = heapstart;
+    void* address = NULL;
+
+    lock_heap(heap);
+    struct Handle* entry = handle_of(heap, handle);
+
+    if (entry != NULL && entry->pins < UINT8_MAX) {
+        entry->pins++;
+        address = heap_storage(heap) + entry->offset;
+    }
+    unlock_heap(heap);
+
+    return address;
+}
+
+int virtual_hunpin(void* heapstart, int32_t handle) {
+    struct Heap* heap = heapstart;
+    int result = 1;
+
+    lock_heap(heap);
+    struct Handle* entry = handle_of(heap, handle);
+
+    if (entry != NULL && entry->pins > 0) {
+        entry->pins--;
+        result = 0;
+    }
+    unlock_heap(heap);
+
+    return result;
+}
+
+int virtual_hfree(void* heapstart, int32_t handle) {
+    struct Heap* heap = heapstart;
+    int result = 1;
+
+    lock_heap(heap);
+    struct Handle* entry = handle_of(heap, handle);
+
+    if (entry != NULL) {
+        entry->used = 0;
+        result = free_block(heapstart, heap_storage(heap) + entry->offset);
+    }
+    unlock_heap(heap);
+
+    return result;
+}
+
+int virtual_compact(void* heapstart, uint32_t budget) {
+    struct Heap* heap = heapstart;
+
+    lock_heap(heap);
+    int moved = compact_blocks(heapstart, budget);
+    unlock_heap(heap);
+
+    return moved;
+}
+
+uint32_t virtual_maintain(void* heapstart, uint32_t budget) {
+    struct Heap* heap = heapstart;
+
+    lock_heap(heap);
+    drain_remote(heap);
+    uint32_t done = maintain(heapstart, budget);
+    unlock_heap(heap);
+
+    return done;
+}
+
+int virtual_worker(void* heapstart, uint32_t period, uint32_t budget) {
+    struct Heap* heap = heapstart;
+
+    // the thread belongs to one process, but the heap to several
+    if (heap->shared)
+        return 1;
+
+    if (period == 0) {
+        if (!heap->running)
+            return 1;
+
+        // wake the worker so that it can see it has been stopped
+        pthread_mutex_lock(&heap->lock);
+        heap->running = 0;
+        pthread_cond_signal(&heap->wake);
+        pthread_mutex_unlock(&heap->lock);
+        pthread_join(heap->worker, NULL);
+
+        coalesce(heap);
+        heap->dirty = 0;
+        heap->locking = 0;
         return 0;
-    } else {
+    }
+
+    if (heap->running)
+        return 1;
+
+    heap->period = period;
+    heap->budget = budget;
+    heap->locking = 1;
+    heap->running = 1;
+
+    if (pthread_create(&heap->worker, NULL, maintain_loop, heapstart) != 0) {
+        heap->locking = 0;
+        heap->running = 0;
         return 1;
     }
 
+    return 0;
 }
 
-void* virtual_realloc(void* heapstart, void* ptr, uint32_t size) {
-    // create backup of tree
+int virtual_config(void* heapstart, uint8_t option, uint64_t value) {
     struct Heap* heap = heapstart;
-    backup_tree(heap, &heap->root);
 
-    int64_t byte_offset = ptr - (heapstart + overhead(heap));
-    struct Parcel parcel = { heap, 0, &byte_offset };
-    uint8_t* node = address_to_node(&heap->root, &parcel);
+    // the lock is replaced, so it cannot be held while sharing
+    if (option == OPT_SHARED)
+        return (value && !heap->shared) ? share_heap(heap) : 1;
 
-    if (virtual_free(heapstart, ptr) == 0) {
-        void* address = virtual_malloc(heapstart, size);
+    lock_heap(heap);
+    int result = configure(heap, option, value);
+    unlock_heap(heap);
 
-        if (address == NULL) {
-            // restore backup of the tree
-            restore_tree(heap, &heap->root);
-        } else {
-            // move the data 
-            uint64_t old_size = 1 << node_size(heap, node);
-            uint64_t min = (old_size < size) ? old_size : size;
-            memmove(address, ptr, min);
-            return address;
-        }
+    return result;
+}
+
+uint32_t virtual_reserve(void* heapstart, uint32_t size, uint32_t count) {
+    struct Heap* heap = heapstart;
+
+    lock_heap(heap);
+    uint32_t reserved = reserve_blocks(heapstart, size, count);
+    unlock_heap(heap);
+
+    return reserved;
+}
+
+void virtual_reset(void* heapstart) {
+    struct Heap* heap = heapstart;
+
+    lock_heap(heap);
+    clear_tree(heap);
+    forget_deferred(heap);
+    if (heap->handles)
+        memset(heap->handles, 0, HANDLES * sizeof(struct Handle));
+    if (heap->reserve)
+        heap->reserve->count = 0;
+    heap->retired = 0;
+    if (heap->samples)
+        memset(heap->samples, 0, SAMPLES * sizeof(struct Sample));
+    unmap_all(heap);
+    heap->remote = 0;
+    heap->dirty = 0;
+    unlock_heap(heap);
+}
+
+void* virtual_subheap(void* heapstart, uint8_t size, uint8_t min_size) {
+    struct Heap layout = { .min_size = min_size, .cur_size = size };
+
+    if (min_size > size || size >= 32 || overhead(&layout) > UINT32_MAX)
+        return NULL;
+
+    // the storage and the data structure are separate blocks, so that
+    // neither is rounded up to twice the size of the sub heap
+    void* storage = virtual_malloc(heapstart, (uint32_t) 1 << size);
+    void* subheap = virtual_malloc(heapstart, overhead(&layout));
+
+    if (storage == NULL || subheap == NULL) {
+        virtual_free(heapstart, storage);
+        virtual_free(heapstart, subheap);
+        return NULL;
     }
 
-    return NULL;
+    init_heap(subheap, (uint64_t) 1 << size, min_size);
+    ((struct Heap*) subheap)->storage = storage - subheap;
+    return subheap;
+}
+
+int virtual_subheap_free(void* heapstart, void* subheap) {
+    struct Heap* heap = subheap;
+
+    if (heap->running)
+        virtual_worker(subheap, 0, 0);
+    configure(heap, OPT_SAMPLE, 0);
+    unmap_all(heap);
+    unmap_tables(heap);
+
+    void* storage = heap_storage(heap);
+    int result = virtual_free(heapstart, subheap);
+    return virtual_free(heapstart, storage) || result;
+}
+
+int virtual_profile(void* heapstart, FILE* out, uint8_t format) {
+    struct Heap* heap = heapstart;
+    int result = 0;
+
+    lock_heap(heap);
+    if (!heap->sample_rate) {
+        result = 1;
+    } else if (heap->samples == NULL) {
+        // nothing has been sampled yet, so the table was never mapped
+        if (format == PROFILE_PPROF)
+            fprintf(out, "heap profile: 0: 0 [0: 0] @ heap_v2/%lu\n", heap->sample_rate);
+        result = (format > PROFILE_PPROF);
+    } else if (format == PROFILE_TEXT) {
+        profile_text(heap, out);
+    } else if (format == PROFILE_PPROF) {
+        profile_pprof(heap, out);
+    } else {
+        result = 1;
+    }
+    unlock_heap(heap);
+
+    return result;
+}
+
+int64_t virtual_offset(void* heapstart, void* ptr) {
+    struct Heap* heap = heapstart;
+    int64_t byte_offset = ptr - heap_storage(heap);
+
+    if (!ptr || byte_offset < 0 || byte_offset >= heap->limit)
+        return -1;
+
+    return byte_offset;
+}
+
+void* virtual_pointer(void* heapstart, int64_t offset) {
+    struct Heap* heap = heapstart;
+
+    if (offset < 0 || offset >= heap->limit)
+        return NULL;
+
+    return heap_storage(heap) + offset;
 }
 
 void virtual_info(void* heapstart) {
     struct Heap* heap = heapstart;
-    allocation_status(heap, &heap->root);
+
+    lock_heap(heap);
+    allocation_status(heap, ROOT);
+    unlock_heap(heap);
 }
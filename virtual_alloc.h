@@ -2,6 +2,75 @@
 #include <stdio.h>
 #include <string.h>
 
+/**
+ * Options which can be configured per heap with virtual_config.
+ *
+ * OPT_POLICY selects one of the placement policies below.
+ * OPT_DEFER, when non zero, keeps freed blocks unmerged in per size
+ * quick lists to be handed straight back to requests of that size.
+ * Buddies are then merged only when a request fails or a list fills.
+ * OPT_ZEROED, when non zero, declares that every free block currently
+ * holds only zeros, such as memory fresh from virtual_sbrk or mmap.
+ * OPT_PURGE, when non zero, lets maintenance return free pages to the
+ * operating system, which is only valid for private anonymous memory,
+ * so shared heaps refuse it.
+ * OPT_SAMPLE, when non zero, records the call stack of an allocation
+ * roughly every 'value' bytes allocated, for virtual_profile. Zero stops
+ * sampling and discards the samples.
+ * OPT_LARGE, when non zero, gives requests of at least 'value' bytes
+ * their own mapping outside the heap, which realloc resizes in place.
+ * OPT_TRIM, when non zero, allocates a request as contiguous blocks
+ * which only just cover it, so its unused trailing buddies stay free.
+ * OPT_SHARED, when non zero, lets processes which map the heap in
+ * shared memory use it together. The heap is then locked by a robust
+ * process shared mutex, and repaired if a process dies holding it.
+ * Sharing cannot be undone. The tables of OPT_DEFER, OPT_LARGE,
+ * OPT_SAMPLE, handles, reservations and epochs are private to each
+ * process, so a shared heap refuses them, as it does virtual_worker.
+ */
+enum option {
+    OPT_POLICY = 0,
+    OPT_DEFER  = 1,
+    OPT_ZEROED = 2,
+    OPT_PURGE  = 3,
+    OPT_SAMPLE = 4,
+    OPT_LARGE  = 5,
+    OPT_TRIM   = 6,
+    OPT_SHARED = 7
+};
+
+/**
+ * Formats in which virtual_profile can write the sampled allocations.
+ * PROFILE_TEXT lists each sample with its stack, PROFILE_PPROF writes
+ * the legacy heap profile format read by pprof.
+ */
+enum profile {
+    PROFILE_TEXT  = 0,
+    PROFILE_PPROF = 1
+};
+
+/**
+ * Placement policies deciding which free block serves a request.
+ * LEFTMOST takes the block with the lowest address, SPLIT_MIN takes
+ * the block in the most heavily used region of the heap.
+ */
+enum policy {
+    LEFTMOST  = 0,
+    SPLIT_MIN = 1
+};
+
+/**
+ * Expected lifetimes of allocations. LIFETIME_ANY blocks are placed as
+ * with virtual_malloc. LIFETIME_LONG blocks are placed as near the start
+ * of the heap as possible and LIFETIME_SHORT blocks as near the end, so
+ * that bursts of short lived blocks can merge back once freed.
+ */
+enum lifetime {
+    LIFETIME_ANY   = 0,
+    LIFETIME_LONG  = 1,
+    LIFETIME_SHORT = 2
+};
+
 /**
  * Initialise memory allocator and the internal buddy allocation data
  * structure with initial_size bytes total memory and a minimum size
@@ -9,6 +78,15 @@
  */
 void init_allocator(void* heapstart, uint8_t initial_size, uint8_t min_size);
 
+/**
+ * Initialise memory allocator with 'bytes' bytes total memory, which
+ * need not be a power of two, and a minimum size for allocation of
+ * min_size. The memory is rounded down to whole blocks of min_size.
+ * Heaps of 2 GiB and above move the break with several calls to
+ * virtual_sbrk, each of at most INT32_MAX bytes.
+ */
+void init_allocator_bytes(void* heapstart, uint64_t bytes, uint8_t min_size);
+
 /**
  * Request a block of 'size' bytes from the memory allocator. On success
  * returns a pointer to this block of allocated memory, else on failure
@@ -16,12 +94,82 @@ void init_allocator(void* heapstart, uint8_t initial_size, uint8_t min_size);
  */
 void* virtual_malloc(void* heapstart, uint32_t size);
 
+/**
+ * Request a zeroed block for 'count' elements of 'size' bytes. Blocks
+ * known to be zero are not cleared again. On success returns a pointer
+ * to the block, else on failure returns NULL.
+ */
+void* virtual_calloc(void* heapstart, uint32_t count, uint32_t size);
+
+/**
+ * Request a block of 'size' bytes which is expected to live for the
+ * given 'lifetime'. On success returns a pointer to the block, else on
+ * failure returns NULL.
+ */
+void* virtual_malloc_hint(void* heapstart, uint32_t size, uint8_t lifetime);
+
+/**
+ * Request a block of 'size' bytes placed in the smallest subtree around
+ * 'hint', a previous allocation, which can fit it. Falls back to the
+ * whole heap if hint is not an allocation, returns NULL on failure.
+ */
+void* virtual_malloc_near(void* heapstart, uint32_t size, void* hint);
+
 /**
  * Free a previously allocated block of memory, if successful returns 0,
  * else returns a non zero number.
  */
 int virtual_free(void* heapstart, void* ptr);
 
+/**
+ * Free a previously allocated block of memory which was requested with
+ * 'size' bytes, going straight to its node instead of searching for
+ * it. If successful returns 0, else returns a non zero number.
+ */
+int virtual_free_sized(void* heapstart, void* ptr, uint32_t size);
+
+/**
+ * Free a previously allocated block of memory from a thread other than
+ * the one using the heap, without locking. The block is queued within
+ * itself, and the queue is freed and merged as a batch by the next
+ * allocation, including objects mapped outside the heap. Heaps whose
+ * blocks are too small to hold the queue link reject every block. If
+ * successful returns 0, else returns a non zero number.
+ */
+int virtual_free_remote(void* heapstart, void* ptr);
+
+/**
+ * Free a previously allocated block of memory once no reader inside an
+ * epoch can still hold it. Retired blocks are released in batches. If
+ * successful returns 0, else returns a non zero number, including when
+ * too many blocks are still held by readers.
+ */
+int virtual_free_deferred(void* heapstart, void* ptr);
+
+/**
+ * Announces that the calling thread is about to read blocks which may be
+ * freed with virtual_free_deferred. Returns the reader's slot, to be
+ * passed to virtual_exit, or -1 if every slot is taken.
+ */
+int32_t virtual_enter(void* heapstart);
+
+/**
+ * Announces that a reader holds no more blocks from its epoch.
+ */
+void virtual_exit(void* heapstart, int32_t reader);
+
+/**
+ * Releases every block from virtual_free_deferred which no reader can
+ * still hold. Returns the number of blocks released.
+ */
+uint32_t virtual_reclaim(void* heapstart);
+
+/**
+ * Returns the number of bytes which can be used in a previously
+ * allocated block of memory, or 0 if ptr is not an allocation.
+ */
+uint64_t virtual_usable_size(void* heapstart, void* ptr);
+
 /**
  * Reallocate a previously allocated block of memory to a block of a
  * different size. On success returns a pointer to the new location,
@@ -29,6 +177,110 @@ int virtual_free(void* heapstart, void* ptr);
  */
 void* virtual_realloc(void* heapstart, void* ptr, uint32_t size);
 
+/**
+ * Request a movable block of 'size' bytes. On success returns a handle
+ * to the block, else on failure returns -1. The block's address is
+ * only stable while it is pinned.
+ */
+int32_t virtual_halloc(void* heapstart, uint32_t size);
+
+/**
+ * Pins a movable block in place and returns its current address, or
+ * NULL if the handle is invalid.
+ */
+void* virtual_hpin(void* heapstart, int32_t handle);
+
+/**
+ * Releases a pin on a movable block, if successful returns 0, else
+ * returns a non zero number.
+ */
+int virtual_hunpin(void* heapstart, int32_t handle);
+
+/**
+ * Free a movable block, if successful returns 0, else returns a non
+ * zero number.
+ */
+int virtual_hfree(void* heapstart, int32_t handle);
+
+/**
+ * Slides at most 'budget' unpinned movable blocks into free space
+ * lower in the heap so that larger free blocks can form. Returns the
+ * number of blocks which were moved.
+ */
+int virtual_compact(void* heapstart, uint32_t budget);
+
+/**
+ * Performs at most 'budget' units of maintenance: merging blocks whose
+ * coalescing was deferred, one level of the tree per unit, purging free
+ * pages, one block visited per unit, and compacting movable blocks.
+ * Returns the number of units performed.
+ */
+uint32_t virtual_maintain(void* heapstart, uint32_t budget);
+
+/**
+ * Starts a background thread performing virtual_maintain with 'budget'
+ * every 'period' milliseconds, which then also merges freed blocks in
+ * place of virtual_free. The heap is locked while the thread runs. A
+ * period of 0 stops the thread. Shared heaps cannot have a worker.
+ * Returns 0 on success, else non zero.
+ */
+int virtual_worker(void* heapstart, uint32_t period, uint32_t budget);
+
+/**
+ * Splits off and faults in up to 'count' blocks for requests of 'size'
+ * bytes, which the next such requests are given without splitting or
+ * faulting. Reserved blocks count as allocated until then. A new
+ * reservation, or a count of 0, first releases the blocks which are
+ * still reserved. Returns the number of blocks reserved.
+ */
+uint32_t virtual_reserve(void* heapstart, uint32_t size, uint32_t count);
+
+/**
+ * Frees every allocation in the heap at once, keeping its configuration.
+ * Handles and queued remote frees are discarded.
+ */
+void virtual_reset(void* heapstart);
+
+/**
+ * Creates a heap of 2^size bytes, with blocks of at least 2^min_size
+ * bytes, out of blocks allocated from the heap at heapstart. Returns the
+ * sub heap, which is used like any other heap, or NULL on failure.
+ */
+void* virtual_subheap(void* heapstart, uint8_t size, uint8_t min_size);
+
+/**
+ * Releases a sub heap, and every allocation in it, back to the heap it
+ * was created from. If successful returns 0, else returns a non zero
+ * number.
+ */
+int virtual_subheap_free(void* heapstart, void* subheap);
+
+/**
+ * Writes the sampled allocations which are still live to 'out' in the
+ * given format. Returns 0 on success, else a non zero number if
+ * sampling is disabled or the format is invalid.
+ */
+int virtual_profile(void* heapstart, FILE* out, uint8_t format);
+
+/**
+ * Returns the offset of 'ptr' from the start of the heap's memory, which
+ * is the same in every process mapping the heap, or -1 if ptr is not in
+ * the heap.
+ */
+int64_t virtual_offset(void* heapstart, void* ptr);
+
+/**
+ * Returns the address in this process of an offset from virtual_offset,
+ * or NULL if the offset is not in the heap.
+ */
+void* virtual_pointer(void* heapstart, int64_t offset);
+
+/**
+ * Sets a configuration 'option' of the heap to 'value'. Returns 0 on
+ * success, else a non zero number if the option or value is invalid.
+ */
+int virtual_config(void* heapstart, uint8_t option, uint64_t value);
+
 /**
  * Prints out the current status of the memory.
  */